@@ -1,5 +1,238 @@
 #pragma once
 
+#include "key_type.h"
+#include "segment_layout.h"
 #include "vk_util.h"
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <map>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <thread>
+#include <vector>
 
-void sort_vec(VkInfo* info);
+// Number of array lengths a sorter keeps recorded by default
+constexpr uint32_t DEFAULT_RECORDINGS_CAPACITY = 8;
+
+class Sorter;
+
+// Sort submitted to the device. The sorted arrays are copied back to the
+// caller's arrays by wait(), which is also called on destruction, so
+// they have to stay alive and untouched until then. Futures must not
+// outlive their sorter
+class SortFuture {
+  public:
+    SortFuture() {}
+    SortFuture(Sorter* sorter, uint64_t submission)
+        : sorter(sorter), submission(submission) {}
+    SortFuture(SortFuture&& other);
+    SortFuture& operator=(SortFuture&& other);
+    ~SortFuture();
+
+    // Whether the device has finished the sort
+    bool ready() const;
+    // Wait for the sort and copy the results back
+    void wait();
+
+    // The coroutine is suspended until the device has finished, then it's
+    // resumed by Sorter::resume_awaiting on the thread owning the sorter.
+    // The sorter's waiting thread only waits for the fence
+    auto operator co_await() {
+        struct Awaiter {
+            SortFuture& future;
+            bool await_ready() const { return future.ready(); }
+            bool await_suspend(std::coroutine_handle<> handle) {
+                VkFence fence = future.fence();
+                if (fence == VK_NULL_HANDLE) {
+                    return false;
+                }
+                future.suspend(fence, handle);
+                return true;
+            }
+            void await_resume() { future.wait(); }
+        };
+        return Awaiter{*this};
+    }
+
+  private:
+    VkFence fence() const;
+    void suspend(VkFence fence, std::coroutine_handle<> handle);
+
+    Sorter* sorter = nullptr;
+    uint64_t submission = 0;
+};
+
+// Sorts arrays of the given key and value types on a device. The kernels
+// are built once per sorter. For each of the recently sorted lengths the
+// array storage and the command buffer with the whole sort recorded are
+// kept, so sorting an array of such a length again is just a submission.
+// Batches of segments are kept the same way by the sizes of their
+// segments rounded up to powers of 2. Arrays longer than the device's
+// chunk size are streamed in chunks, see submit_chunks.
+// A sorter isn't thread-safe
+class Sorter {
+  public:
+    // Sorters on different compute queues of a device run concurrently
+    Sorter(KeyType key_type, ValueType value_type, VkInfo* info,
+           uint32_t recordings_capacity = DEFAULT_RECORDINGS_CAPACITY,
+           uint32_t queue_index = 0);
+    ~Sorter();
+    Sorter(const Sorter&) = delete;
+    Sorter& operator=(const Sorter&) = delete;
+
+    // Longest array the device sorts at once
+    size_t max_size() const;
+
+    // Resume the coroutines awaiting the futures of this sorter on
+    // the calling thread as their sorts finish, returns once none of
+    // them is suspended any more
+    void resume_awaiting();
+
+    template <typename T> void sort(std::span<T> keys) {
+        sort_async(keys).wait();
+    }
+
+    // Every value is moved together with the key of the same index
+    template <typename T, typename V>
+    void sort(std::span<T> keys, std::span<V> values) {
+        sort_async(keys, values).wait();
+    }
+
+    // The keys are copied to the device's buffers before returning
+    template <typename T> SortFuture sort_async(std::span<T> keys) {
+        check_types(key_type_of<T>(), NoValue);
+        return submit(keys.data(), nullptr, keys.size());
+    }
+
+    template <typename T, typename V>
+    SortFuture sort_async(std::span<T> keys, std::span<V> values) {
+        check_types(key_type_of<T>(), value_type_of<V>());
+        if (keys.size() != values.size()) {
+            throw std::runtime_error("keys and values differ in length");
+        }
+        return submit(keys.data(), values.data(), keys.size());
+    }
+
+    // Sort every segment [offsets[k], offsets[k + 1]) of the keys
+    // independently, the whole batch is sorted by a single submission
+    template <typename T>
+    void sort_segments(std::span<T> keys, std::span<const uint32_t> offsets) {
+        sort_segments_async(keys, offsets).wait();
+    }
+
+    template <typename T, typename V>
+    void sort_segments(std::span<T> keys, std::span<V> values,
+                       std::span<const uint32_t> offsets) {
+        sort_segments_async(keys, values, offsets).wait();
+    }
+
+    template <typename T>
+    SortFuture sort_segments_async(std::span<T> keys,
+                                   std::span<const uint32_t> offsets) {
+        check_types(key_type_of<T>(), NoValue);
+        return submit_segments(keys.data(), nullptr, keys.size(), offsets);
+    }
+
+    template <typename T, typename V>
+    SortFuture sort_segments_async(std::span<T> keys, std::span<V> values,
+                                   std::span<const uint32_t> offsets) {
+        check_types(key_type_of<T>(), value_type_of<V>());
+        if (keys.size() != values.size()) {
+            throw std::runtime_error("keys and values differ in length");
+        }
+        return submit_segments(keys.data(), values.data(), keys.size(),
+                               offsets);
+    }
+
+  private:
+    friend class SortFuture;
+
+    // Payloads of the maximal keys of a padded part of the caller's
+    // arrays ending at end. These keys tie with the padding, so the network
+    // may leave the padding's payloads in their place, and theirs are
+    // written back over the last ones of the part once it's sorted
+    struct Ties {
+        size_t end;
+        std::vector<char> values;
+    };
+
+    // Part of an array streamed on its own: the upload on the transfer
+    // queue, the local sort waiting for it on the compute queue and
+    // the download waiting for the whole sort on the transfer queue
+    struct Chunk {
+        VkCommandBuffer upload;
+        VkCommandBuffer sort;
+        VkCommandBuffer download;
+        VkSemaphore uploaded;
+        VkSemaphore sorted;
+        VkFence downloaded;
+    };
+
+    // Array of a fixed layout with the descriptor set pointing to it,
+    // the command buffer sorting it and the fence of the last submission.
+    // An array in flight is copied back to the caller's arrays before
+    // the recording is used again. Streamed arrays have their chunks,
+    // the command buffer and the fence are then the ones of the global
+    // layers only
+    struct Recording {
+        Layout layout;
+        ArrayStorage arr;
+        VkDescriptorSet descriptor_set;
+        VkCommandBuffer command_buffer;
+        VkFence fence;
+        bool in_flight = false;
+        uint64_t submission = 0;
+        void* keys = nullptr;
+        void* values = nullptr;
+        std::vector<Segment> segments = {};
+        std::vector<Ties> ties = {};
+        std::vector<Chunk> chunks = {};
+    };
+
+    void check_types(KeyType key_type, ValueType value_type) const;
+    SortFuture submit(void* keys, void* values, size_t n);
+    SortFuture submit_segments(void* keys, void* values, size_t n,
+                               std::span<const uint32_t> offsets);
+    SortFuture submit(const Layout& layout, std::vector<Segment> segments,
+                      std::vector<Ties> ties, void* keys, void* values);
+    void save_ties(const void* keys, const void* values, size_t offset,
+                   uint32_t length, std::vector<Ties>& ties) const;
+    void submit_chunks(Recording& recording);
+    Recording* find_submission(uint64_t submission);
+    bool finished(const Recording& recording);
+    void complete(Recording& recording);
+    void use_recording(const Layout& layout);
+    void make_current(const Recording& recording);
+    void release(Recording& recording);
+    void record(const Layout& layout, const std::vector<Chunk>& chunks);
+    void await_fence(VkFence fence, std::coroutine_handle<> handle);
+    void wait_fences();
+    void wait_fence_released(VkFence fence);
+
+    KeyType key_type;
+    ValueType value_type;
+    SortInfo info;
+    uint32_t recordings_capacity;
+    // Elements per streamed chunk, a multiple of the local kernel's
+    // block, or 0 when the arrays are transferred whole
+    uint32_t chunk_size;
+    uint64_t submissions = 0;
+    // Least recently used recordings are at the back
+    std::list<Recording> recordings;
+    std::map<Layout, std::list<Recording>::iterator> recordings_by_layout;
+    // Fences of the awaited sorts queued for the waiting thread, each one
+    // stays at the front until it's signaled, and the coroutines it hands
+    // back. The only state shared with that thread
+    std::mutex awaiting_mutex;
+    std::condition_variable awaiting_ready;
+    std::condition_variable fences_queued;
+    std::deque<std::pair<VkFence, std::coroutine_handle<>>> awaited_fences;
+    std::vector<std::coroutine_handle<>> resumable;
+    std::thread fence_waiter;
+    bool stopping = false;
+    size_t awaiting = 0;
+};
@@ -0,0 +1,356 @@
+#pragma once
+
+#include "opts.h"
+#include "simd_sort.h"
+#include "task_graph.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <barrier>
+#include <bit>
+#include <cstdint>
+#include <initializer_list>
+#include <span>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// Sorts arrays on the CPU by the same odd-even merge network as the
+// Vulkan sorter. The sequence of comparisons doesn't depend on the keys.
+// Like the local kernel on the device, the merge groups up to a tile
+// that fits in the cache are sorted tile by tile. Of the layers of the
+// larger merge groups, the ones with strides of a tile or more sweep the
+// array, split between the threads of a pool. The rest cross the tiles
+// only at their ends, they run tile by tile with the tiles of every next
+// layer shifted back by its stride, see merge_tiles. The threads either
+// meet at a barrier after each of these steps or go on with the tiles
+// that are ready, see CpuSchedule. Without payloads the blocks of
+// the SIMD kernels are sorted in registers
+class CpuSorter {
+  public:
+    // 0 threads is a thread per hardware thread,
+    // tiles of 0 bytes take half of the L2 cache
+    explicit CpuSorter(uint32_t threads = 0, size_t tile_bytes = 0,
+                       CpuSchedule schedule = Dataflow);
+
+    uint32_t threads() const { return pool.size(); }
+    size_t get_tile_bytes() const { return tile_bytes; }
+    CpuSchedule get_schedule() const { return schedule; }
+
+    template <typename T> void sort(std::span<T> keys) {
+        sort_network<T, char>(keys.data(), nullptr, keys.size());
+    }
+
+    // Every value is moved together with the key of the same index
+    template <typename T, typename V>
+    void sort(std::span<T> keys, std::span<V> values) {
+        if (keys.size() != values.size()) {
+            throw std::runtime_error("keys and values differ in length");
+        }
+        sort_network(keys.data(), values.data(), keys.size());
+    }
+
+  private:
+    // Array being sorted, kernels are set when there are no payloads
+    template <typename T, typename V> struct Network {
+        T* keys;
+        V* values;
+        size_t n;
+        const SimdKernels<T>* kernels;
+
+        // Comparators of the layer whose left elements are in [lo, hi),
+        // the left elements of a layer lie in runs of stride elements
+        void apply(size_t merge_group_size, size_t stride, size_t inner_rem,
+                   size_t lo, size_t hi) const {
+            hi = std::min(hi, n > stride ? n - stride : 0);
+            size_t stride_trailing_zeros = std::countr_zero(stride);
+            size_t blocks = merge_group_size / stride;
+            for (size_t i = lo; i < hi;) {
+                size_t k = i >> stride_trailing_zeros;
+                size_t end = std::min((k + 1) << stride_trailing_zeros, hi);
+                size_t inner = k & (blocks - 1);
+                if (inner_rem == 0 ? inner % 2 == 0
+                                   : inner % 2 == 1 && inner != blocks - 1) {
+                    compare(i, stride, end - i);
+                }
+                i = end;
+            }
+        }
+
+        // Short runs of keys alone are compared without branches in place
+        void compare(size_t i, size_t stride, size_t count) const {
+            if (kernels != nullptr && count >= 8) {
+                kernels->compare(keys + i, keys + i + stride, count);
+                return;
+            }
+            if (kernels != nullptr) {
+                for (size_t j = i; j < i + count; j++) {
+                    T a = keys[j];
+                    T b = keys[j + stride];
+                    keys[j] = b < a ? b : a;
+                    keys[j + stride] = b < a ? a : b;
+                }
+                return;
+            }
+            for (size_t j = i; j < i + count; j++) {
+                if (keys[j + stride] < keys[j]) {
+                    std::swap(keys[j], keys[j + stride]);
+                    if (values != nullptr) {
+                        std::swap(values[j], values[j + stride]);
+                    }
+                }
+            }
+        }
+
+        // The layers of the strides below the tile of a merge group
+        // larger than it. The thread runs its region [begin, end) tile by
+        // tile, a layer's range starts back by the strides of the layers
+        // since the first one, so the elements it reads are done by
+        // the earlier layers of the same or the previous tiles. Inside
+        // the array its range also starts forward at begin by the strides
+        // of the layers before it and stops half a tile before end, so
+        // only the elements of the region are touched. The comparators
+        // left out around the boundaries are in merge_boundary
+        void merge_tiles(size_t merge_group_size, size_t tile, size_t begin,
+                         size_t end) const {
+            size_t last = end == n ? n : end - tile / 2;
+            for (size_t first = begin; first < end; first += tile) {
+                size_t back = 0;
+                size_t forward = 0;
+                for (size_t stride = tile / 2; stride >= 1; stride >>= 1) {
+                    back += stride == tile / 2 ? 0 : stride;
+                    size_t start =
+                        begin == 0 ? first
+                                   : std::max(first, begin + forward + back);
+                    size_t stop = std::min(first + tile, last);
+                    apply(merge_group_size, stride, 1,
+                          first == 0 ? 0 : start - back,
+                          stop == n ? n : stop - back);
+                    forward += stride;
+                }
+            }
+        }
+
+        // Merge groups up to the tile of the elements [lo, hi)
+        void sort_tile(size_t lo, size_t hi, size_t block,
+                       size_t tile) const {
+            for (size_t b = lo; block > 1 && b < hi; b += block) {
+                kernels->sort_block(keys + b, std::min(block, hi - b));
+            }
+            for (size_t merge_group_size = 2 * block; merge_group_size <= tile;
+                 merge_group_size <<= 1) {
+                size_t inner_rem = 0;
+                for (size_t stride = merge_group_size >> 1; stride >= 1;
+                     stride >>= 1) {
+                    apply(merge_group_size, stride, inner_rem, lo, hi);
+                    inner_rem = 1;
+                }
+            }
+        }
+
+        // The comparators around the boundary of two regions left out
+        // by merge_tiles, once both regions are done. They touch the tile
+        // on either side of it
+        void merge_boundary(size_t merge_group_size, size_t tile,
+                            size_t boundary) const {
+            size_t back = 0;
+            size_t forward = 0;
+            for (size_t stride = tile / 2; stride >= 1; stride >>= 1) {
+                back += stride == tile / 2 ? 0 : stride;
+                apply(merge_group_size, stride, 1, boundary - tile / 2 - back,
+                      boundary + forward);
+                forward += stride;
+            }
+        }
+    };
+
+    // Regions are made of whole tiles, the last one ends with the array
+    static size_t region_bound(size_t n, size_t tile, size_t regions,
+                               size_t region) {
+        size_t tiles = (n + tile - 1) / tile;
+        return region == regions ? n : tile * (tiles * region / regions);
+    }
+
+    template <typename T, typename V>
+    void sort_network(T* keys, V* values, size_t n) {
+        if (n < 2) {
+            return;
+        }
+        const SimdKernels<T>& kernels = simd_kernels<T>();
+        size_t block = values == nullptr ? kernels.block : 1;
+        if (n <= block) {
+            kernels.sort_block(keys, n);
+            return;
+        }
+        Network<T, V> network{keys, values, n,
+                              values == nullptr ? &kernels : nullptr};
+        size_t element_size = sizeof(T) + (values == nullptr ? 0 : sizeof(V));
+        size_t tile = std::clamp(std::bit_floor(tile_bytes / element_size),
+                                 block, std::bit_ceil(n));
+        if (schedule == Barriers) {
+            sort_barriers(network, block, tile);
+        } else {
+            sort_dataflow(network, block, tile);
+        }
+    }
+
+    template <typename T, typename V>
+    void sort_barriers(const Network<T, V>& network, size_t block,
+                       size_t tile) {
+        size_t n = network.n;
+        size_t N = std::bit_ceil(n);
+        uint32_t threads = pool.size();
+        // Regions of the threads are wide enough for the comparators
+        // around their boundaries to stay inside the neighbouring ones
+        size_t regions = std::clamp<size_t>(n / (4 * tile), 1, threads);
+        std::barrier sync(threads);
+        pool.run([&](uint32_t thread) {
+            size_t tiles = (n + tile - 1) / tile;
+            for (size_t t = tiles * thread / threads;
+                 t < tiles * (thread + 1) / threads; t++) {
+                network.sort_tile(t * tile, std::min(n, (t + 1) * tile),
+                                  block, tile);
+            }
+            sync.arrive_and_wait();
+
+            for (size_t merge_group_size = 2 * tile; merge_group_size <= N;
+                 merge_group_size <<= 1) {
+                for (size_t stride = merge_group_size >> 1; stride >= tile;
+                     stride >>= 1) {
+                    network.apply(merge_group_size, stride,
+                                  stride == merge_group_size >> 1 ? 0 : 1,
+                                  n * thread / threads,
+                                  n * (thread + 1) / threads);
+                    sync.arrive_and_wait();
+                }
+                if (thread < regions) {
+                    network.merge_tiles(
+                        merge_group_size, tile,
+                        region_bound(n, tile, regions, thread),
+                        region_bound(n, tile, regions, thread + 1));
+                }
+                sync.arrive_and_wait();
+                for (size_t region = thread + 1; region < regions;
+                     region += threads) {
+                    network.merge_boundary(
+                        merge_group_size, tile,
+                        region_bound(n, tile, regions, region));
+                }
+                sync.arrive_and_wait();
+            }
+        });
+    }
+
+    // The pieces of the barrier schedule become tasks: the sorted tiles,
+    // the tiles of the left elements of the layers with strides of a tile
+    // or more, the regions of merge_tiles and their boundaries. A task
+    // waits for the last earlier tasks writing any of the tiles it
+    // touches, so a tile goes on to the next merge group as soon as
+    // the tiles it's compared with are done
+    template <typename T, typename V>
+    void sort_dataflow(const Network<T, V>& network, size_t block,
+                       size_t tile) {
+        size_t n = network.n;
+        size_t N = std::bit_ceil(n);
+        // Every thread gets a couple of regions to start with
+        tile = std::clamp(std::bit_floor(n / (8 * pool.size())), block, tile);
+        size_t regions = std::max<size_t>(n / (4 * tile), 1);
+
+        enum Kind { SortTile, Sweep, MergeTiles, MergeBoundary };
+        struct Task {
+            Kind kind;
+            size_t merge_group_size;
+            size_t stride;
+            size_t lo;
+            size_t hi;
+        };
+        std::vector<Task> tasks;
+        TaskGraph graph;
+        std::vector<uint32_t> last_writers((n + tile - 1) / tile, UINT32_MAX);
+        std::vector<uint32_t> deps;
+        // The ranges are the elements the task reads and writes
+        auto add = [&](const Task& task,
+                       std::initializer_list<std::pair<size_t, size_t>>
+                           ranges) {
+            deps.clear();
+            for (auto [lo, hi] : ranges) {
+                for (size_t t = lo / tile; t < (hi + tile - 1) / tile; t++) {
+                    if (last_writers[t] != UINT32_MAX) {
+                        deps.push_back(last_writers[t]);
+                    }
+                }
+            }
+            std::sort(deps.begin(), deps.end());
+            deps.erase(std::unique(deps.begin(), deps.end()), deps.end());
+            uint32_t index = graph.add(deps);
+            tasks.push_back(task);
+            for (auto [lo, hi] : ranges) {
+                for (size_t t = lo / tile; t < (hi + tile - 1) / tile; t++) {
+                    last_writers[t] = index;
+                }
+            }
+        };
+
+        for (size_t lo = 0; lo < n; lo += tile) {
+            size_t hi = std::min(n, lo + tile);
+            add({SortTile, 0, 0, lo, hi}, {{lo, hi}});
+        }
+        for (size_t merge_group_size = 2 * tile; merge_group_size <= N;
+             merge_group_size <<= 1) {
+            for (size_t stride = merge_group_size >> 1; stride >= tile;
+                 stride >>= 1) {
+                size_t inner_rem = stride == merge_group_size >> 1 ? 0 : 1;
+                size_t blocks = merge_group_size / stride;
+                for (size_t lo = 0; lo + stride < n; lo += tile) {
+                    size_t inner = lo / stride & (blocks - 1);
+                    bool left = inner_rem == 0
+                                    ? inner % 2 == 0
+                                    : inner % 2 == 1 && inner != blocks - 1;
+                    if (!left) {
+                        continue;
+                    }
+                    size_t hi = std::min(lo + tile, n - stride);
+                    add({Sweep, merge_group_size, stride, lo, hi},
+                        {{lo, hi}, {lo + stride, hi + stride}});
+                }
+            }
+            // The regions are independent of each other, only the
+            // boundaries wait for both of their sides
+            for (size_t region = 0; region < regions; region++) {
+                size_t lo = region_bound(n, tile, regions, region);
+                size_t hi = region_bound(n, tile, regions, region + 1);
+                add({MergeTiles, merge_group_size, 0, lo, hi}, {{lo, hi}});
+            }
+            for (size_t region = 1; region < regions; region++) {
+                size_t boundary = region_bound(n, tile, regions, region);
+                add({MergeBoundary, merge_group_size, 0, boundary, boundary},
+                    {{boundary - tile, std::min(n, boundary + tile)}});
+            }
+        }
+
+        graph.run(pool, [&](uint32_t index) {
+            const Task& task = tasks[index];
+            switch (task.kind) {
+            case SortTile:
+                network.sort_tile(task.lo, task.hi, block, tile);
+                break;
+            case Sweep:
+                network.apply(task.merge_group_size, task.stride,
+                              task.stride == task.merge_group_size >> 1 ? 0
+                                                                        : 1,
+                              task.lo, task.hi);
+                break;
+            case MergeTiles:
+                network.merge_tiles(task.merge_group_size, tile, task.lo,
+                                    task.hi);
+                break;
+            case MergeBoundary:
+                network.merge_boundary(task.merge_group_size, tile, task.lo);
+                break;
+            }
+        });
+    }
+
+    ThreadPool pool;
+    size_t tile_bytes;
+    CpuSchedule schedule;
+};
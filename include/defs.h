@@ -1,4 +1,14 @@
+#pragma once
+
+/* Shaders get the key type from the compiler flags */
+#ifndef TYPE
 #define TYPE float
-#define CTYPE float
-#define TILE_SIZE 256
-#define NUM_PUSH_CSTS 6
+#endif
+#define REGISTER_RUN 8
+#define REGISTER_RUN_ID 0
+#define TILE_SIZE_ID 1
+#define PADDED_ID 2
+#define MAX_LOCAL_LEVELS 16
+#define NUM_PUSH_CSTS (3 + MAX_LOCAL_LEVELS)
+/* Workgroups per row of a grid too long for a single row */
+#define GRID_WIDTH 32768
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <optional>
+
+// Ranges of a memory block bound to no buffer, by their offsets. Ranges
+// are taken first fit, and given back merged with the free ones next
+// to them
+class FreeRanges {
+  public:
+    // A taken range starts with the padding up to the aligned offset
+    struct Range {
+        uint64_t start;
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    // The whole block of the given size is free
+    explicit FreeRanges(uint64_t size);
+
+    // Take size bytes at an offset aligned to alignment from the first
+    // free range with room for them, if there is one
+    std::optional<Range> take(uint64_t size, uint64_t alignment);
+    // Give the range [start, start + size) back
+    void give(uint64_t start, uint64_t size);
+
+    // Sizes of the free ranges by their offsets
+    const std::map<uint64_t, uint64_t>& get() const { return ranges; }
+
+  private:
+    std::map<uint64_t, uint64_t> ranges;
+};
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "cpu_sorter.h"
+#include "key_type.h"
+#include "multi_sorter.h"
+#include "vk_util.h"
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Sorts arrays on the devices and the CPU at once: the devices sort the
+// first part of the array while the threads of the CPU backend sort the
+// rest, then the two runs are merged on the host. The devices' share
+// follows the throughput both sides had in the previous sorts, so that
+// they finish together. It's kept in the cache directory between runs
+class HybridSorter {
+  public:
+    // Without a cache directory the devices start with half of the array
+    HybridSorter(KeyType key_type, ValueType value_type,
+                 const std::vector<VkInfo*>& infos, uint32_t threads,
+                 CpuSchedule schedule, const std::string& cache_dir);
+    ~HybridSorter();
+    HybridSorter(const HybridSorter&) = delete;
+    HybridSorter& operator=(const HybridSorter&) = delete;
+
+    // Fraction of the array sorted by the devices
+    double device_share() const { return share; }
+
+    size_t queues() const { return device_sorter.size(); }
+    uint32_t threads() const { return cpu_sorter.threads(); }
+
+    template <typename T> void sort(std::span<T> keys) {
+        sort_split<T, void>(keys, nullptr);
+    }
+
+    template <typename T, typename V>
+    void sort(std::span<T> keys, std::span<V> values) {
+        if (keys.size() != values.size()) {
+            throw std::runtime_error("keys and values differ in length");
+        }
+        sort_split<T, V>(keys, values.data());
+    }
+
+  private:
+    // Both sides are timed up to their sorted runs, transfers included.
+    // The runs of the devices' parts and the CPU's one are merged at once
+    template <typename T, typename V>
+    void sort_split(std::span<T> keys, V* values) {
+        using seconds = std::chrono::duration<double>;
+        size_t n = keys.size();
+        size_t split = static_cast<size_t>(n * share);
+        std::vector<size_t> bounds = {0};
+        double device_time = 0;
+        // Thrown on the device's thread and rethrown once it's joined
+        std::exception_ptr device_error;
+        std::thread device_thread([&] {
+            if (split == 0) {
+                return;
+            }
+            auto begin = std::chrono::steady_clock::now();
+            try {
+                if constexpr (std::is_void_v<V>) {
+                    bounds = device_sorter.sort_runs(keys.first(split));
+                } else {
+                    bounds = device_sorter.sort_runs(keys.first(split),
+                                                     std::span{values, split});
+                }
+            } catch (...) {
+                device_error = std::current_exception();
+                return;
+            }
+            device_time =
+                seconds(std::chrono::steady_clock::now() - begin).count();
+        });
+        auto begin = std::chrono::steady_clock::now();
+        try {
+            if constexpr (std::is_void_v<V>) {
+                cpu_sorter.sort(keys.subspan(split));
+            } else {
+                cpu_sorter.sort(keys.subspan(split),
+                                std::span{values + split, n - split});
+            }
+        } catch (...) {
+            device_thread.join();
+            throw;
+        }
+        double cpu_time =
+            seconds(std::chrono::steady_clock::now() - begin).count();
+        device_thread.join();
+        if (device_error) {
+            std::rethrow_exception(device_error);
+        }
+        bounds.push_back(n);
+        merge_runs(keys, values, std::move(bounds));
+        calibrate(split, device_time, n - split, cpu_time);
+    }
+
+    // Move the share halfway to the one equalizing the times of the sort
+    // just done, judged by the keys per second of each side. Short arrays
+    // leave it as it is
+    void calibrate(size_t device_keys, double device_time, size_t cpu_keys,
+                   double cpu_time);
+
+    MultiSorter device_sorter;
+    CpuSorter cpu_sorter;
+    double share = 0.5;
+    // File keeping the share, empty without a cache directory
+    std::string share_path;
+};
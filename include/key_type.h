@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+// Key types the kernels are compiled for,
+// the order matches the shader tables in shaders/CMakeLists.txt
+enum KeyType { U32, I32, U64, I64, F32, F64 };
+
+constexpr size_t NUM_KEY_TYPES = 6;
+
+constexpr const char* KEY_TYPE_NAMES[NUM_KEY_TYPES] = {"u32", "i32", "u64",
+                                                       "i64", "f32", "f64"};
+
+constexpr size_t KEY_TYPE_SIZES[NUM_KEY_TYPES] = {4, 4, 8, 8, 4, 8};
+
+template <typename T> constexpr KeyType key_type_of();
+template <> constexpr KeyType key_type_of<uint32_t>() { return U32; }
+template <> constexpr KeyType key_type_of<int32_t>() { return I32; }
+template <> constexpr KeyType key_type_of<uint64_t>() { return U64; }
+template <> constexpr KeyType key_type_of<int64_t>() { return I64; }
+template <> constexpr KeyType key_type_of<float>() { return F32; }
+template <> constexpr KeyType key_type_of<double>() { return F64; }
+
+// The maximal key, which pads the arrays
+template <typename T> constexpr T sentinel() {
+    return std::numeric_limits<T>::has_infinity
+               ? std::numeric_limits<T>::infinity()
+               : std::numeric_limits<T>::max();
+}
+
+inline KeyType parse_key_type(const std::string& name) {
+    for (size_t type = 0; type < NUM_KEY_TYPES; type++) {
+        if (name == KEY_TYPE_NAMES[type]) {
+            return static_cast<KeyType>(type);
+        }
+    }
+    throw std::runtime_error("unknown key type " + name);
+}
+
+// Call f.template operator()<T>() with the C++ type of the key type
+template <typename F> decltype(auto) visit_key_type(KeyType type, F&& f) {
+    switch (type) {
+    case U32:
+        return f.template operator()<uint32_t>();
+    case I32:
+        return f.template operator()<int32_t>();
+    case U64:
+        return f.template operator()<uint64_t>();
+    case I64:
+        return f.template operator()<int64_t>();
+    case F32:
+        return f.template operator()<float>();
+    case F64:
+        return f.template operator()<double>();
+    }
+    throw std::runtime_error("unknown key type");
+}
+
+// Payloads carried with the keys, the order matches the shader tables
+enum ValueType { NoValue, V32, V64 };
+
+constexpr size_t NUM_VALUE_TYPES = 3;
+
+constexpr size_t VALUE_TYPE_SIZES[NUM_VALUE_TYPES] = {0, 4, 8};
+
+template <typename V> constexpr ValueType value_type_of();
+template <> constexpr ValueType value_type_of<uint32_t>() { return V32; }
+template <> constexpr ValueType value_type_of<uint64_t>() { return V64; }
+
+// Payloads are given by their width in bits, 0 means keys only
+inline ValueType parse_value_type(uint32_t bits) {
+    switch (bits) {
+    case 0:
+        return NoValue;
+    case 32:
+        return V32;
+    case 64:
+        return V64;
+    }
+    throw std::runtime_error("unsupported value width " +
+                             std::to_string(bits));
+}
+
+// Call f.template operator()<V>() with the C++ type of the payload,
+// void if there is none
+template <typename F> decltype(auto) visit_value_type(ValueType type, F&& f) {
+    switch (type) {
+    case NoValue:
+        return f.template operator()<void>();
+    case V32:
+        return f.template operator()<uint32_t>();
+    case V64:
+        return f.template operator()<uint64_t>();
+    }
+    throw std::runtime_error("unknown value type");
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include "batcher_sort.h"
+#include "key_type.h"
+#include "simd_sort.h"
+#include "vk_util.h"
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Merge the sorted runs [a, a_end) and [b, b_end) of the keys into out
+// from position k, values are moved with their keys if there are any.
+// Keys alone are merged by the SIMD kernels
+template <typename T, typename V>
+void merge_pair(const T* keys, const V* values, size_t a, size_t a_end,
+                size_t b, size_t b_end, T* out, V* out_values, size_t k) {
+    if (values == nullptr) {
+        simd_kernels<T>().merge(keys + a, a_end - a, keys + b, b_end - b,
+                                out + k);
+        return;
+    }
+    for (; a < a_end && b < b_end; k++) {
+        size_t from = keys[b] < keys[a] ? b++ : a++;
+        out[k] = keys[from];
+        out_values[k] = values[from];
+    }
+    std::copy(keys + a, keys + a_end, out + k);
+    std::copy(keys + b, keys + b_end, out + k + (a_end - a));
+    std::copy(values + a, values + a_end, out_values + k);
+    std::copy(values + b, values + b_end, out_values + k + (a_end - a));
+}
+
+// Number of the first d merged keys of the sorted runs [lo, mid) and
+// [mid, hi) that come from the first run, equal keys are taken from
+// the first run first
+template <typename T>
+size_t merge_path(const T* keys, size_t lo, size_t mid, size_t hi, size_t d) {
+    size_t low = d > hi - mid ? d - (hi - mid) : 0;
+    size_t high = std::min(d, mid - lo);
+    while (low < high) {
+        size_t i = low + (high - low) / 2;
+        if (keys[mid + d - i - 1] < keys[lo + i]) {
+            high = i;
+        } else {
+            low = i + 1;
+        }
+    }
+    return low;
+}
+
+// Keys a thread merges at least when a merge is split between threads
+constexpr size_t MIN_MERGE_PIECE = 1 << 16;
+
+// Merge the sorted runs [bounds[r], bounds[r + 1]) of the keys pairwise
+// until a single one is left. The merges of a round run on threads
+// of their own, when there are fewer merges than hardware threads each
+// of them is cut along the merge path into pieces for several threads
+template <typename T, typename V>
+void merge_runs(std::span<T> keys, V* values, std::vector<size_t> bounds) {
+    using Value = std::conditional_t<std::is_void_v<V>, char, V>;
+    std::vector<T> key_buf(keys.size());
+    std::vector<Value> value_buf(values == nullptr ? 0 : keys.size());
+    T* src = keys.data();
+    T* dst = key_buf.data();
+    Value* values_src = static_cast<Value*>(values);
+    Value* values_dst = values == nullptr ? nullptr : value_buf.data();
+    size_t hardware_threads =
+        std::max(1u, std::thread::hardware_concurrency());
+    while (bounds.size() > 2) {
+        std::vector<size_t> merged = {0};
+        std::vector<std::thread> threads;
+        size_t merges = bounds.size() / 2;
+        for (size_t r = 0; r + 1 < bounds.size(); r += 2) {
+            size_t lo = bounds[r];
+            size_t mid = bounds[r + 1];
+            size_t hi = r + 2 < bounds.size() ? bounds[r + 2] : mid;
+            size_t pieces =
+                std::clamp((hi - lo) / MIN_MERGE_PIECE, size_t{1},
+                           std::max(size_t{1}, hardware_threads / merges));
+            for (size_t p = 0; p < pieces; p++) {
+                size_t d = (hi - lo) * p / pieces;
+                size_t d_end = (hi - lo) * (p + 1) / pieces;
+                threads.emplace_back([=] {
+                    size_t i = merge_path(src, lo, mid, hi, d);
+                    size_t i_end = merge_path(src, lo, mid, hi, d_end);
+                    merge_pair<T, Value>(src, values_src, lo + i, lo + i_end,
+                                         mid + d - i, mid + d_end - i_end,
+                                         dst, values_dst, lo + d);
+                });
+            }
+            merged.push_back(hi);
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        std::swap(src, dst);
+        std::swap(values_src, values_dst);
+        bounds = std::move(merged);
+    }
+    if (src != keys.data()) {
+        std::copy(src, src + keys.size(), keys.data());
+        if (values != nullptr) {
+            std::copy(values_src, values_src + keys.size(),
+                      static_cast<Value*>(values));
+        }
+    }
+}
+
+// Sorts arrays on every compute queue of several devices at once: the
+// array is split into a part per queue, the parts are sorted by sorters
+// of their own and merged on the host. Arrays too long for the devices
+// are split into more parts, which the sorters take in turn
+class MultiSorter {
+  public:
+    MultiSorter(KeyType key_type, ValueType value_type,
+                const std::vector<VkInfo*>& infos);
+
+    size_t size() const { return sorters.size(); }
+
+    template <typename T> void sort(std::span<T> keys) {
+        merge_runs<T, void>(keys, nullptr, sort_runs(keys));
+    }
+
+    template <typename T, typename V>
+    void sort(std::span<T> keys, std::span<V> values) {
+        merge_runs(keys, values.data(), sort_runs(keys, values));
+    }
+
+    // Sort the parts of the array without merging them, returns the
+    // bounds of the sorted runs for merge_runs
+    template <typename T> std::vector<size_t> sort_runs(std::span<T> keys) {
+        return sort_parts<T, void>(keys, nullptr);
+    }
+
+    template <typename T, typename V>
+    std::vector<size_t> sort_runs(std::span<T> keys, std::span<V> values) {
+        if (keys.size() != values.size()) {
+            throw std::runtime_error("keys and values differ in length");
+        }
+        return sort_parts<T, V>(keys, values.data());
+    }
+
+  private:
+    // Parts are submitted one after another, so copying a part to its
+    // device overlaps with sorting the previous ones
+    template <typename T, typename V>
+    std::vector<size_t> sort_parts(std::span<T> keys, V* values) {
+        size_t max_part = SIZE_MAX;
+        for (const auto& sorter : sorters) {
+            max_part = std::min(max_part, sorter->max_size());
+        }
+        size_t parts = std::max<size_t>(
+            {1, std::min<size_t>(sorters.size(), keys.size()),
+             (keys.size() + max_part - 1) / max_part});
+        std::vector<size_t> bounds;
+        for (size_t p = 0; p <= parts; p++) {
+            bounds.push_back(keys.size() * p / parts);
+        }
+        std::vector<SortFuture> futures;
+        for (size_t p = 0; p < parts; p++) {
+            auto part = keys.subspan(bounds[p], bounds[p + 1] - bounds[p]);
+            Sorter& sorter = *sorters[p % sorters.size()];
+            if constexpr (std::is_void_v<V>) {
+                futures.push_back(sorter.sort_async(part));
+            } else {
+                futures.push_back(sorter.sort_async(
+                    part, std::span{values + bounds[p], part.size()}));
+            }
+        }
+        for (SortFuture& future : futures) {
+            future.wait();
+        }
+        return bounds;
+    }
+
+    std::vector<std::unique_ptr<Sorter>> sorters;
+};
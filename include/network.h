@@ -0,0 +1,43 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+
+// Numbering of the comparators of a layer of the odd-even merge network,
+// shared by the kernels (see get_left_index in shaders/common.glsl) and
+// the CPU backend. A layer of merge groups of size merge_group_size with
+// the given stride has the left elements in the even stride blocks when
+// inner_rem is 0, otherwise in the odd ones except the last block of
+// each merge group. Comparators are numbered in the increasing order of
+// their left elements
+
+// Number of positions below u which belong to even stride blocks
+inline size_t even_block_prefix(size_t u, size_t stride) {
+    return u / (2 * stride) * stride + std::min(u % (2 * stride), stride);
+}
+
+// Number of comparators of the layer whose right element is inside
+// the array, these are exactly the first ones in the numbering
+inline size_t count_comparators(size_t n, size_t merge_group_size,
+                                size_t stride, size_t inner_rem) {
+    if (inner_rem == 0) {
+        return n > stride ? even_block_prefix(n - stride, stride) : 0;
+    }
+    // The first stride block of a merge group holds no right elements
+    size_t rem = n % merge_group_size;
+    return n / merge_group_size * (merge_group_size / 2 - stride) +
+           even_block_prefix(rem, stride) - std::min(rem, stride);
+}
+
+// Left element of the c-th comparator of the layer
+inline size_t left_index(size_t c, size_t merge_group_size, size_t stride,
+                         size_t inner_rem) {
+    if (inner_rem == 0) {
+        return c / stride * 2 * stride + c % stride;
+    }
+    size_t group_comparators = merge_group_size / 2 - stride;
+    size_t group = c / group_comparators;
+    size_t inner_c = c - group * group_comparators;
+    return group * merge_group_size + stride + inner_c / stride * 2 * stride +
+           inner_c % stride;
+}
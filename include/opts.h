@@ -1,10 +1,43 @@
 #pragma once
 
+#include "key_type.h"
 #include <cstdint>
+#include <string>
+
+// Where the arrays are sorted, auto picks a Vulkan device if there is
+// a usable one and the CPU otherwise
+enum Backend { Vulkan, Cpu, Auto };
+
+// How the threads of the CPU backend wait for the comparators the next
+// ones depend on: at a barrier after every layer swept across the array,
+// or by running each piece of the network once the pieces writing
+// the same tiles before it are done, see TaskGraph
+enum CpuSchedule { Barriers, Dataflow };
+
+constexpr const char* CPU_SCHEDULE_NAMES[] = {"barriers", "dataflow"};
 
 struct Options {
-    uint32_t n;
+    uint64_t n;
     uint32_t seed;
+    uint32_t register_run;
+    uint32_t tile_size;
+    KeyType key_type;
+    ValueType value_type;
+    bool padded;
+    uint32_t segments;
+    uint32_t chunk_size;
+    bool staging;
+    bool multi;
+    bool hybrid;
+    std::string split_cache_dir;
+    int device;
+    bool list_devices;
+    Backend backend;
+    uint32_t threads;
+    CpuSchedule schedule;
+    bool scaling;
+    std::string pipeline_cache_dir;
+    bool pipeline_times;
     bool debug;
 
   public:
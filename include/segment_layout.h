@@ -0,0 +1,33 @@
+#pragma once
+
+#include <compare>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+// What a recorded sort depends on: the length of the array and, for
+// a batch of segments, bounds[l] is the length of the prefix holding
+// the segments of at least 2^(l+1) elements. Segments are laid out
+// by decreasing sizes, each padded to a power of 2, so the merge
+// groups of every size below its bound lie inside single segments
+struct Layout {
+    uint32_t n;
+    std::vector<uint32_t> bounds;
+    auto operator<=>(const Layout&) const = default;
+};
+
+// Part of the caller's array placed in the device's array
+struct Segment {
+    size_t offset;
+    uint32_t padded_offset;
+    uint32_t length;
+    uint32_t padded_length;
+};
+
+// Lay out the segments [offsets[k], offsets[k + 1]) of an array of n
+// elements as a batch of at most max_size elements. Segments shorter
+// than 2 are sorted already and are left out, without any segments
+// left the layout is empty
+Layout lay_out_segments(std::span<const uint32_t> offsets, size_t n,
+                        size_t max_size, std::vector<Segment>& segments);
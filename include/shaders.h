@@ -1,8 +1,14 @@
 #pragma once
+#include "key_type.h"
 #include <cstddef>
 
-constexpr unsigned char MERGE_SHADER[] = {
-#include "shaders/merge_dump.h"
+struct ShaderCode {
+    const unsigned char* data;
+    size_t len;
 };
 
-constexpr size_t MERGE_SHADER_LEN = sizeof(MERGE_SHADER);
+// Defines <KERNEL>_SHADERS tables holding a variant per value and key type
+#include "shaders/shader_table.h"
+
+static_assert(sizeof(MERGE_SHADERS) / sizeof(MERGE_SHADERS[0]) ==
+              NUM_VALUE_TYPES);
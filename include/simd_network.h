@@ -0,0 +1,245 @@
+#pragma once
+
+#include "key_type.h"
+#include "simd_sort.h"
+#include <cstddef>
+#include <utility>
+
+// The odd-even merge network of network.h applied to keys in registers.
+// Element e of a block is in the lane e % WIDTH of the register
+// e / WIDTH. An instruction set is described by a struct Isa with
+// the key type T and the register type V holding WIDTH keys, and with:
+//   load, store, and lane by lane min and max;
+//   permute(v, index), the lanes of v picked by an index;
+//   blend(a, b, mask), the lanes of b where the mask is set and of a
+//   elsewhere;
+//   constexpr index(lanes) and mask(lanes) building the index and
+//   the mask of an array per lane.
+// This header is included by the translation units of the instruction
+// sets only, each of them instantiates the kernels with its own Isa
+
+#define SIMD_INLINE inline __attribute__((always_inline))
+
+// Whether e is the left or the right element of a comparator
+// of the layer, see left_index
+constexpr bool is_left(size_t e, size_t merge_group_size, size_t stride,
+                       size_t inner_rem) {
+    size_t k = e % merge_group_size / stride;
+    return inner_rem == 0 ? k % 2 == 0
+                          : k % 2 == 1 && k != merge_group_size / stride - 1;
+}
+
+constexpr bool is_right(size_t e, size_t merge_group_size, size_t stride,
+                        size_t inner_rem) {
+    size_t k = e % merge_group_size / stride;
+    return inner_rem == 0 ? k % 2 == 1 : k % 2 == 0 && k != 0;
+}
+
+// Partners of the lanes of a register in a layer whose stride is below
+// the width. They are in the register itself, or for the odd layers
+// at its ends in the neighbouring registers
+struct LaneLayer {
+    int lane[MAX_SIMD_WIDTH] = {};
+    bool from_prev[MAX_SIMD_WIDTH] = {};
+    bool from_next[MAX_SIMD_WIDTH] = {};
+    bool takes_max[MAX_SIMD_WIDTH] = {};
+    bool uses_prev = false;
+    bool uses_next = false;
+};
+
+constexpr LaneLayer lane_layer(size_t width, size_t reg,
+                               size_t merge_group_size, size_t stride,
+                               size_t inner_rem) {
+    LaneLayer layer;
+    for (size_t l = 0; l < width; l++) {
+        size_t e = reg * width + l;
+        size_t partner = e;
+        if (is_left(e, merge_group_size, stride, inner_rem)) {
+            partner = e + stride;
+        } else if (is_right(e, merge_group_size, stride, inner_rem)) {
+            partner = e - stride;
+            layer.takes_max[l] = true;
+        }
+        layer.lane[l] = partner % width;
+        layer.from_prev[l] = partner / width < reg;
+        layer.from_next[l] = partner / width > reg;
+        layer.uses_prev |= layer.from_prev[l];
+        layer.uses_next |= layer.from_next[l];
+    }
+    return layer;
+}
+
+// Registers holding whole stride blocks are compared with each other
+template <typename Isa, size_t Reg, size_t M, size_t S, size_t IR>
+SIMD_INLINE void compare_registers(typename Isa::V* v) {
+    constexpr size_t W = Isa::WIDTH;
+    if constexpr (is_left(Reg * W, M, S, IR)) {
+        typename Isa::V lo = Isa::min(v[Reg], v[Reg + S / W]);
+        typename Isa::V hi = Isa::max(v[Reg], v[Reg + S / W]);
+        v[Reg] = lo;
+        v[Reg + S / W] = hi;
+    }
+}
+
+// Lanes of a register compared with their partners' lanes
+template <typename Isa, size_t Reg, size_t M, size_t S, size_t IR>
+SIMD_INLINE typename Isa::V compare_lanes(const typename Isa::V* v) {
+    static constexpr LaneLayer layer = lane_layer(Isa::WIDTH, Reg, M, S, IR);
+    static constexpr auto index = Isa::index(layer.lane);
+    static constexpr auto takes_max = Isa::mask(layer.takes_max);
+    typename Isa::V partner = Isa::permute(v[Reg], index);
+    if constexpr (layer.uses_prev) {
+        static constexpr auto from_prev = Isa::mask(layer.from_prev);
+        partner =
+            Isa::blend(partner, Isa::permute(v[Reg - 1], index), from_prev);
+    }
+    if constexpr (layer.uses_next) {
+        static constexpr auto from_next = Isa::mask(layer.from_next);
+        partner =
+            Isa::blend(partner, Isa::permute(v[Reg + 1], index), from_next);
+    }
+    return Isa::blend(Isa::min(v[Reg], partner), Isa::max(v[Reg], partner),
+                      takes_max);
+}
+
+template <typename Isa, size_t M, size_t S, size_t IR, size_t... Regs>
+SIMD_INLINE void apply_layer(typename Isa::V* v,
+                             std::index_sequence<Regs...>) {
+    if constexpr (S >= Isa::WIDTH) {
+        (compare_registers<Isa, Regs, M, S, IR>(v), ...);
+    } else {
+        typename Isa::V out[] = {compare_lanes<Isa, Regs, M, S, IR>(v)...};
+        ((v[Regs] = out[Regs]), ...);
+    }
+}
+
+// Layers merging the sorted halves of every merge group of size M
+template <typename Isa, size_t R, size_t M, size_t S = M / 2>
+SIMD_INLINE void merge_layers(typename Isa::V* v) {
+    apply_layer<Isa, M, S, S == M / 2 ? 0 : 1>(v,
+                                               std::make_index_sequence<R>{});
+    if constexpr (S > 1) {
+        merge_layers<Isa, R, M, S / 2>(v);
+    }
+}
+
+template <typename Isa, size_t R, size_t M = 2>
+SIMD_INLINE void sort_layers(typename Isa::V* v) {
+    merge_layers<Isa, R, M>(v);
+    if constexpr (M < R * Isa::WIDTH) {
+        sort_layers<Isa, R, M * 2>(v);
+    }
+}
+
+// A short block is padded with the maximal keys
+template <typename Isa>
+void sort_block(typename Isa::T* keys, size_t count) {
+    using T = typename Isa::T;
+    constexpr size_t W = Isa::WIDTH;
+    constexpr size_t BLOCK = SIMD_REGISTERS * W;
+    constexpr T PAD = sentinel<T>();
+    T padded[BLOCK];
+    T* src = keys;
+    if (count < BLOCK) {
+        for (size_t k = 0; k < BLOCK; k++) {
+            padded[k] = k < count ? keys[k] : PAD;
+        }
+        src = padded;
+    }
+    typename Isa::V v[SIMD_REGISTERS];
+    for (size_t r = 0; r < SIMD_REGISTERS; r++) {
+        v[r] = Isa::load(src + r * W);
+    }
+    sort_layers<Isa, SIMD_REGISTERS>(v);
+    for (size_t r = 0; r < SIMD_REGISTERS; r++) {
+        Isa::store(src + r * W, v[r]);
+    }
+    if (count < BLOCK) {
+        for (size_t k = 0; k < count; k++) {
+            keys[k] = padded[k];
+        }
+    }
+}
+
+// A register of the merged keys is merged with the next register of
+// the input whose next key is smaller, the lower half of the result
+// goes out. Once that input has no whole register left, the upper half
+// and the rest of both inputs are merged key by key
+template <typename Isa>
+void merge(const typename Isa::T* a, size_t na, const typename Isa::T* b,
+           size_t nb, typename Isa::T* out) {
+    using T = typename Isa::T;
+    constexpr size_t W = Isa::WIDTH;
+    T upper[W];
+    size_t nu = 0;
+    size_t i = 0;
+    size_t j = 0;
+    if (na >= W && nb >= W) {
+        typename Isa::V v[2] = {Isa::load(a), Isa::load(b)};
+        i = W;
+        j = W;
+        while (true) {
+            merge_layers<Isa, 2, 2 * W>(v);
+            Isa::store(out, v[0]);
+            out += W;
+            if (i < na && (j == nb || a[i] <= b[j])) {
+                if (i + W > na) {
+                    break;
+                }
+                v[0] = Isa::load(a + i);
+                i += W;
+            } else if (j < nb) {
+                if (j + W > nb) {
+                    break;
+                }
+                v[0] = Isa::load(b + j);
+                j += W;
+            } else {
+                break;
+            }
+        }
+        Isa::store(upper, v[1]);
+        nu = W;
+    }
+    size_t u = 0;
+    while (u < nu || i < na || j < nb) {
+        bool from_u = u < nu && (i == na || upper[u] <= a[i]) &&
+                      (j == nb || upper[u] <= b[j]);
+        if (from_u) {
+            *out++ = upper[u++];
+        } else if (i < na && (j == nb || a[i] <= b[j])) {
+            *out++ = a[i++];
+        } else {
+            *out++ = b[j++];
+        }
+    }
+}
+
+// A layer of the network over two runs of the array
+template <typename Isa>
+void compare(typename Isa::T* lo, typename Isa::T* hi, size_t count) {
+    using T = typename Isa::T;
+    constexpr size_t W = Isa::WIDTH;
+    size_t k = 0;
+    for (; k + W <= count; k += W) {
+        typename Isa::V a = Isa::load(lo + k);
+        typename Isa::V b = Isa::load(hi + k);
+        Isa::store(lo + k, Isa::min(a, b));
+        Isa::store(hi + k, Isa::max(a, b));
+    }
+    for (; k < count; k++) {
+        T a = lo[k];
+        T b = hi[k];
+        lo[k] = b < a ? b : a;
+        hi[k] = b < a ? a : b;
+    }
+}
+
+template <typename Isa> SimdKernels<typename Isa::T> make_kernels() {
+    return {
+        .block = SIMD_REGISTERS * Isa::WIDTH,
+        .sort_block = sort_block<Isa>,
+        .merge = merge<Isa>,
+        .compare = compare<Isa>,
+    };
+}
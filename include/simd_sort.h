@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+
+// Instruction sets of the CPU kernels, the best one the CPU supports
+// is picked at runtime
+enum SimdLevel { Scalar, Avx2, Avx512 };
+
+constexpr const char* SIMD_LEVEL_NAMES[] = {"scalar", "avx2", "avx512"};
+
+SimdLevel simd_level();
+
+// Registers of a block sorted by the kernels at once
+constexpr size_t SIMD_REGISTERS = 8;
+
+// Keys per register at most, 32-bit keys of AVX-512
+constexpr size_t MAX_SIMD_WIDTH = 16;
+
+constexpr size_t MAX_SIMD_BLOCK = SIMD_REGISTERS * MAX_SIMD_WIDTH;
+
+// Kernels of an instruction set for keys of a type. Keys equal to
+// the maximal one may change places with the padding of a short block,
+// so the kernels carry no payloads
+template <typename T> struct SimdKernels {
+    // Keys sorted in registers at once, a power of 2
+    size_t block;
+    // Sort the keys [0, count) for count <= block
+    void (*sort_block)(T* keys, size_t count);
+    // Merge the sorted a[0, na) and b[0, nb) into out
+    void (*merge)(const T* a, size_t na, const T* b, size_t nb, T* out);
+    // Put min(lo[k], hi[k]) into lo[k] and the max into hi[k]
+    // for every k < count
+    void (*compare)(T* lo, T* hi, size_t count);
+};
+
+// Kernels of the best instruction set for the key types of key_type.h
+template <typename T> const SimdKernels<T>& simd_kernels();
+
+// Kernels of each instruction set, built with the flags enabling it
+template <typename T> SimdKernels<T> scalar_kernels();
+template <typename T> SimdKernels<T> avx2_kernels();
+template <typename T> SimdKernels<T> avx512_kernels();
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "thread_pool.h"
+#include <cstdint>
+#include <functional>
+#include <span>
+#include <utility>
+#include <vector>
+
+// Tasks of a job with the tasks each of them has to wait for. The threads
+// of a pool run a task as soon as the ones it depends on are done instead
+// of meeting at barriers. Every thread keeps the tasks it made ready in
+// a deque of its own and steals from the others once it runs out
+class TaskGraph {
+  public:
+    // Add a task run after the given earlier ones, returns its index
+    uint32_t add(std::span<const uint32_t> deps);
+
+    uint32_t size() const { return dep_counts.size(); }
+
+    // Run every task by its index, returns once all of them are done
+    void run(ThreadPool& pool,
+             const std::function<void(uint32_t)>& task) const;
+
+  private:
+    std::vector<uint32_t> dep_counts;
+    // Pairs of a task and one of the tasks waiting for it
+    std::vector<std::pair<uint32_t, uint32_t>> edges;
+};
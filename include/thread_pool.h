@@ -0,0 +1,38 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Threads kept for running jobs on all of them at once, the calling
+// thread takes part in every job as thread 0
+class ThreadPool {
+  public:
+    // 0 threads is a thread per hardware thread
+    explicit ThreadPool(uint32_t threads = 0);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    uint32_t size() const { return workers.size() + 1; }
+
+    // Run the job on every thread with the thread's index,
+    // returns once all of them are done
+    void run(const std::function<void(uint32_t)>& job);
+
+  private:
+    void work(uint32_t index);
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(uint32_t)>* job = nullptr;
+    // Jobs started so far, a worker runs each of them once
+    uint64_t jobs = 0;
+    uint32_t running = 0;
+    bool stopping = false;
+};
@@ -8,16 +8,91 @@
 #include <vector>
 #include <vulkan/vulkan.h>
 
+// Host and device buffers of an array, whatever its element type is,
+// and of the payloads carried with the elements if there are any.
+// The key buffers can hold padded_n >= n elements, the padding
+// is never copied back. Unified storage has a single host-visible
+// device buffer serving as both, nothing is transferred then
+class ArrayStorage {
+  public:
+    ArrayStorage(uint32_t n, size_t element_size, size_t value_size = 0,
+                 uint32_t padded_n = 0, bool unified = false)
+        : n(n), padded_n(std::max(n, padded_n)), buf_size(element_size * n),
+          padded_buf_size(element_size * std::max(n, padded_n)),
+          value_buf_size(value_size * n), unified(unified) {}
+    ArrayStorage() {}
+    void*& get_mapped() { return mapped; }
+    void* get_mapped() const { return mapped; }
+    uint32_t get_elements_num() const { return n; }
+    uint32_t get_padded_elements_num() const { return padded_n; }
+    VkDeviceSize get_buffer_size() const { return buf_size; }
+    VkDeviceSize get_element_size() const { return n == 0 ? 0 : buf_size / n; }
+    VkDeviceSize get_padded_buffer_size() const { return padded_buf_size; }
+    bool has_values() const { return value_buf_size != 0; }
+    bool is_unified() const { return unified; }
+    void*& get_values_mapped() { return values_mapped; }
+    void* get_values_mapped() const { return values_mapped; }
+    VkDeviceSize get_values_buffer_size() const { return value_buf_size; }
+    VkDeviceSize get_value_size() const {
+        return n == 0 ? 0 : value_buf_size / n;
+    }
+    VkBuffer& get_host_buffer() { return host_buffer; }
+    const VkBuffer& get_host_buffer() const { return host_buffer; }
+    VkBuffer& get_device_buffer() { return device_buffer; }
+    const VkBuffer& get_device_buffer() const { return device_buffer; }
+    VkDeviceMemory& get_host_memory() { return host_memory; }
+    const VkDeviceMemory& get_host_memory() const { return host_memory; }
+    VkDeviceMemory& get_device_memory() { return device_memory; }
+    const VkDeviceMemory& get_device_memory() const { return device_memory; }
+    VkBuffer& get_values_host_buffer() { return values_host_buffer; }
+    const VkBuffer& get_values_host_buffer() const {
+        return values_host_buffer;
+    }
+    VkBuffer& get_values_device_buffer() { return values_device_buffer; }
+    const VkBuffer& get_values_device_buffer() const {
+        return values_device_buffer;
+    }
+    VkDeviceMemory& get_values_host_memory() { return values_host_memory; }
+    const VkDeviceMemory& get_values_host_memory() const {
+        return values_host_memory;
+    }
+    VkDeviceMemory& get_values_device_memory() { return values_device_memory; }
+    const VkDeviceMemory& get_values_device_memory() const {
+        return values_device_memory;
+    }
+
+  private:
+    uint32_t n = 0;
+    uint32_t padded_n = 0;
+    void* mapped;
+    size_t buf_size;
+    size_t padded_buf_size;
+    VkBuffer host_buffer;
+    VkBuffer device_buffer;
+    VkDeviceMemory host_memory;
+    VkDeviceMemory device_memory;
+    void* values_mapped = nullptr;
+    size_t value_buf_size = 0;
+    VkBuffer values_host_buffer = VK_NULL_HANDLE;
+    VkBuffer values_device_buffer = VK_NULL_HANDLE;
+    VkDeviceMemory values_host_memory = VK_NULL_HANDLE;
+    VkDeviceMemory values_device_memory = VK_NULL_HANDLE;
+    bool unified = false;
+};
+
+// Typed view of the mapped host buffer of a storage
 template <typename T> class Array {
   public:
     using element_type = T;
-    Array(uint32_t n) : n(n), buf_size(sizeof(element_type) * n) {}
-    Array() {}
+    Array(const ArrayStorage& storage)
+        : n(storage.get_elements_num()),
+          buf(static_cast<element_type*>(storage.get_mapped())) {}
+    Array(size_t n, element_type* buf) : n(n), buf(buf) {}
     void fill_random(uint32_t seed) {
         std::mt19937 gen(seed);
         if constexpr (std::is_integral<T>::value) {
             std::uniform_int_distribution<T> dis( //
-                0, std::numeric_limits<T>::max());
+                std::numeric_limits<T>::min(), std::numeric_limits<T>::max());
             std::generate(buf, buf + n, [&]() { return dis(gen); });
 
         } else {
@@ -26,41 +101,26 @@ template <typename T> class Array {
             std::generate(buf, buf + n, [&]() { return dis(gen); });
         }
     }
-    void debug_print(uint32_t n) {
+    void debug_print(size_t n) {
         std::cout << "---- ARRAY BEGIN ---" << std::endl;
-        for (uint32_t i = 0; i < n; i++) {
+        for (size_t i = 0; i < n; i++) {
             std::cout << buf[i] << ' ';
         }
         std::cout << std::endl;
         std::cout << "----  ARRAY END  ---" << std::endl;
     }
     bool compare_with_reference(const std::vector<T>& ref) {
-        for (uint32_t i = 0; i < n; i++) {
+        for (size_t i = 0; i < n; i++) {
             if (buf[i] != ref[i]) {
                 return false;
             }
         }
         return true;
     }
-    element_type*& get_buffer() { return buf; }
-    uint32_t get_elements_num() { return n; }
-    VkDeviceSize get_buffer_size() { return buf_size; }
-    VkBuffer& get_host_buffer() { return host_buffer; }
-    const VkBuffer& get_host_buffer() const { return host_buffer; }
-    VkBuffer& get_device_buffer() { return device_buffer; }
-    const VkBuffer& get_device_buffer() const { return device_buffer; }
-    VkDeviceMemory& get_host_memory() { return host_memory; }
-    const VkDeviceMemory& get_host_memory() const { return host_memory; }
-    VkDeviceMemory& get_device_memory() { return device_memory; }
-    const VkDeviceMemory& get_device_memory() const { return device_memory; }
-    ~Array() {}
+    element_type* get_buffer() { return buf; }
+    size_t get_elements_num() { return n; }
 
   private:
-    uint32_t n;
+    size_t n;
     element_type* buf;
-    size_t buf_size;
-    VkBuffer host_buffer;
-    VkBuffer device_buffer;
-    VkDeviceMemory host_memory;
-    VkDeviceMemory device_memory;
 };
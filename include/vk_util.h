@@ -1,15 +1,31 @@
 #pragma once
 
 #include "defs.h"
+#include "free_ranges.h"
+#include "key_type.h"
 #include "vk_array.h"
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
 #include <vector>
 #include <vulkan/vulkan.h>
 
 using push_cst_t = uint32_t;
 
-enum MemoryAccessType { Transfer, Shader };
+enum MemoryAccessType { Transfer, Shader, Host };
+
+enum KernelType { Merge, MergeRadix4, LocalMerge };
+
+constexpr size_t NUM_KERNELS = 3;
+
+// Compute queues opened per device at most
+constexpr uint32_t MAX_COMPUTE_QUEUES = 16;
 
 [[maybe_unused]] static std::string err_string(VkResult err_code) {
     switch (err_code) {
@@ -56,61 +72,228 @@ enum MemoryAccessType { Transfer, Shader };
         }                                                                      \
     }
 
+// Values of the kernels' specialization constants
+struct SpecConstants {
+    uint32_t register_run = REGISTER_RUN;
+    uint32_t tile_size;
+    VkBool32 padded = VK_FALSE;
+};
+
+// Memory blocks sub-allocated to buffers. The ranges of a block bound
+// to no buffer are merged with their free neighbours, and a block left
+// without buffers is freed. Buffers released by their arrays are kept for
+// reuse by the arrays of the same size class up to MAX_FREE_BUFFER_BYTES,
+// the ones released first go back to their blocks first. The sorters of
+// a device share the pool from any thread, the mutex guards it
+struct MemoryPool {
+    // Block of a memory type, host-visible ones stay mapped
+    struct Block {
+        VkDeviceMemory memory;
+        VkDeviceSize size;
+        void* mapped;
+        FreeRanges free_ranges;
+        uint32_t buffers;
+    };
+    // Buffer bound to a range of a block, the range starts with
+    // the padding up to the buffer's alignment
+    struct Buffer {
+        VkBuffer buffer;
+        VkDeviceMemory memory;
+        void* mapped;
+        VkBufferUsageFlags usage;
+        VkMemoryPropertyFlags properties;
+        VkDeviceSize size_class;
+        uint32_t memory_type;
+        VkDeviceSize range_offset;
+        VkDeviceSize range_size;
+        // Releases before this one's, while it's kept for reuse
+        uint64_t released;
+    };
+    using Key =
+        std::tuple<VkBufferUsageFlags, VkMemoryPropertyFlags, VkDeviceSize>;
+
+    std::mutex mutex;
+    std::vector<Block> blocks[VK_MAX_MEMORY_TYPES];
+    std::map<Key, std::vector<Buffer>> free_buffers;
+    VkDeviceSize free_buffer_bytes = 0;
+    uint64_t releases = 0;
+    std::unordered_map<VkBuffer, Buffer> used_buffers;
+};
+
+// Device shared by the sorters
 struct VkInfo {
-    Array<CTYPE> arr;
-    VkCommandBuffer command_buffer;
-    VkCommandPool command_pool;
-    VkDescriptorPool descriptor_pool;
-    VkDescriptorSet descriptor_set;
-    VkDescriptorSetLayout descriptor_set_layout;
     VkDevice device;
     VkInstance instance;
     VkPhysicalDevice physical_device;
+    VkPhysicalDeviceFeatures enabled_features;
     VkPhysicalDeviceMemoryProperties memory_properties;
-    VkPipeline pipeline;
-    VkPipelineLayout pipeline_layout;
+    VkPhysicalDeviceProperties properties;
+    VkPhysicalDeviceSubgroupProperties subgroup_properties;
+    // Queues of the compute family, queue is the first one
     VkQueue queue;
-    VkShaderModule shader_module;
+    std::vector<VkQueue> queues;
+    // Queue of a transfer-only family if the device has one,
+    // the compute queue otherwise
+    VkQueue transfer_queue;
+    // Shared by the pipelines of all sorters, saved to the path if any
+    VkPipelineCache pipeline_cache = VK_NULL_HANDLE;
+    std::string pipeline_cache_path;
+    // Defaults for the sorters created on the device
+    SpecConstants spec_constants;
+    // Elements per chunk streamed through the transfer queue,
+    // 0 transfers the arrays whole
+    uint32_t chunk_size = 0;
     uint32_t queue_family_index;
+    uint32_t transfer_queue_family_index;
+    // Whether the arrays are kept in host-visible device memory
+    // and sorted in place
+    bool unified_memory;
+    MemoryPool memory_pool;
+};
+
+// Objects of a single sorter: its kernels specialized for a key and
+// a value type, and the pools for its arrays. The array, the descriptor
+// set pointing to it, the command buffer with its sort recorded and
+// the fence of its submission are the ones the sorter currently works with
+struct SortInfo {
+    VkInfo* vk_info;
+    ArrayStorage arr;
+    VkCommandBuffer command_buffer;
+    VkCommandPool command_pool;
+    VkCommandPool transfer_command_pool;
+    VkDescriptorPool descriptor_pool;
+    VkDescriptorSet descriptor_set;
+    VkDescriptorSetLayout descriptor_set_layout;
+    VkFence fence;
+    // Compute queue of the sorter
+    VkQueue queue;
+    VkPipeline pipelines[NUM_KERNELS];
+    VkPipelineLayout pipeline_layout;
+    VkShaderModule shader_modules[NUM_KERNELS];
+    SpecConstants spec_constants;
 };
 
 void set_instance(VkInfo* vk_info);
 
-void set_physical_device(VkInfo* vk_info);
+uint32_t count_physical_devices(VkInfo* vk_info);
+
+bool is_suitable_device(uint32_t device_index, VkInfo* vk_info);
+
+uint32_t select_device(VkInfo* vk_info);
+
+void list_devices(std::ostream& out);
+
+void set_physical_device(VkInfo* vk_info, uint32_t device_index = 0);
+
+uint32_t default_tile_size(VkInfo* vk_info);
+
+bool supports_subgroup_shuffles(uint32_t tile_size, VkInfo* vk_info);
+
+bool supports_key_type(KeyType key_type, VkInfo* vk_info);
 
-void create_shader(const unsigned char* data, size_t size, VkInfo* vk_info);
+void create_pipeline_cache(const std::string& dir, VkInfo* vk_info);
 
-void create_shader_from_file(std::string name, VkInfo* vk_info);
+void save_pipeline_cache(VkInfo* vk_info);
+
+// Replace the file by the data at once through a temporary file of its
+// own, so that concurrent processes never read or publish a partially
+// written file. Failures are reported as saving the given thing, but
+// not thrown, since the callers run on teardown
+void replace_file(const std::string& path, std::string_view data,
+                  const char* what);
+
+void create_descriptor_pool(uint32_t num_bindings, uint32_t max_sets,
+                            SortInfo* sort_info);
+
+void allocate_descriptor_set(SortInfo* sort_info);
+
+void write_descriptor_set(SortInfo* sort_info);
+
+void free_descriptor_set(SortInfo* sort_info);
+
+void create_command_pool(SortInfo* sort_info);
+
+void allocate_command_buffer(SortInfo* sort_info);
+
+void free_command_buffer(SortInfo* sort_info);
+
+void allocate_transfer_command_buffer(SortInfo* sort_info);
+
+void free_transfer_command_buffer(SortInfo* sort_info);
+
+void create_shader(const unsigned char* data, size_t size, KernelType kernel,
+                   SortInfo* sort_info);
+
+void create_shader_from_file(std::string name, KernelType kernel,
+                             SortInfo* sort_info);
 
 uint32_t find_memory_type(uint32_t typeFilter, VkMemoryPropertyFlags properties,
                           VkInfo* vk_info);
 
-void create_buffer(VkDeviceSize size, VkBufferUsageFlags usage,
-                   VkMemoryPropertyFlags properties, VkBuffer& buffer,
-                   VkDeviceMemory& bufferMemory, VkInfo* vk_info);
+void* create_buffer(VkDeviceSize size, VkBufferUsageFlags usage,
+                    VkMemoryPropertyFlags properties, VkBuffer& buffer,
+                    VkDeviceMemory& bufferMemory, VkInfo* vk_info);
+
+void destroy_buffer(VkBuffer buffer, VkInfo* vk_info);
+
+void destroy_memory_pool(VkInfo* vk_info);
+
+void load_input(SortInfo* sort_info);
 
-void load_input(VkInfo* vk_info);
+void load_input(uint32_t first, uint32_t count, SortInfo* sort_info);
 
-void load_output(VkInfo* vk_info);
+void load_output(SortInfo* sort_info);
 
-void begin_command_buffer(VkInfo* vk_info);
+void load_output(uint32_t first, uint32_t count, SortInfo* sort_info);
 
-void end_command_buffer(VkInfo* vk_info);
+void fill_padding(uint32_t pattern, SortInfo* sort_info);
 
-void bind_constants(const std::vector<push_cst_t>& push_csts, VkInfo* vk_info);
+void load_padding(SortInfo* sort_info);
 
-void dispatch(uint32_t n, uint32_t tile_size, VkInfo* vk_info);
+void begin_command_buffer(SortInfo* sort_info);
 
-void submit(VkInfo* vk_info);
+void end_command_buffer(SortInfo* sort_info);
+
+void bind_constants(const std::vector<push_cst_t>& push_csts,
+                    SortInfo* sort_info);
+
+void dispatch(uint32_t n, uint32_t tile_size, KernelType kernel,
+              SortInfo* sort_info);
+
+void submit(SortInfo* sort_info);
+
+void submit(VkQueue queue, VkSemaphore wait_semaphore,
+            const std::vector<VkSemaphore>& signal_semaphores, VkFence fence,
+            SortInfo* sort_info);
+
+void create_fence(SortInfo* sort_info);
+
+void destroy_fence(SortInfo* sort_info);
+
+void wait_fence(VkFence fence, VkInfo* vk_info);
+
+bool fence_signaled(VkFence fence, VkInfo* vk_info);
+
+VkSemaphore create_semaphore(VkInfo* vk_info);
+
+void destroy_semaphore(VkSemaphore semaphore, VkInfo* vk_info);
+
+void destroy_device(VkInfo* vk_info);
 
 void destroy(VkInfo* vk_info);
 
+void destroy_sort_info(SortInfo* sort_info);
+
 void put_write_read_barrier(MemoryAccessType m_src, MemoryAccessType m_dst,
-                            VkInfo* vk_info);
+                            SortInfo* sort_info);
 
-Array<CTYPE> create_array_storage(uint32_t n, VkInfo* vk_info);
+uint32_t padded_size(uint32_t n, SortInfo* sort_info);
 
-void destroy_array_storage(const Array<CTYPE>& arr, VkInfo* vk_info);
+ArrayStorage create_array_storage(uint32_t n, size_t element_size,
+                                  size_t value_size, uint32_t padded_n,
+                                  VkInfo* vk_info);
+
+void destroy_array_storage(const ArrayStorage& arr, VkInfo* vk_info);
 
 struct VkInfoGuard {
     VkInfo info;
@@ -118,3 +301,11 @@ struct VkInfoGuard {
     VkInfo* get();
     ~VkInfoGuard();
 };
+
+// A single device, or every suitable one of them sharing an instance
+struct VkDevicesGuard {
+    std::vector<std::unique_ptr<VkInfo>> infos;
+    VkDevicesGuard(bool all_devices, int device_index = -1);
+    std::vector<VkInfo*> get();
+    ~VkDevicesGuard();
+};
@@ -0,0 +1,84 @@
+layout(set = 0, binding = 0) buffer Arr {
+  TYPE buf[];
+} a;
+
+#ifdef VALUE_TYPE
+/* Payload moved together with every key */
+layout(set = 0, binding = 1) buffer Vals {
+  VALUE_TYPE buf[];
+} vals;
+#endif
+
+/* Whether the array is padded with the maximal keys up to a power of 2
+ * covering whole blocks of the local kernel. Every comparator is live
+ * then, and the bounds checks are compiled out */
+layout(constant_id = PADDED_ID) const bool padded = false;
+
+/* A key with its payload */
+struct Elem {
+  TYPE key;
+#ifdef VALUE_TYPE
+  VALUE_TYPE value;
+#endif
+};
+
+Elem load_element(uint i) {
+  Elem e;
+  e.key = a.buf[i];
+#ifdef VALUE_TYPE
+  e.value = vals.buf[i];
+#endif
+  return e;
+}
+
+void store_element(uint i, Elem e) {
+  a.buf[i] = e.key;
+#ifdef VALUE_TYPE
+  vals.buf[i] = e.value;
+#endif
+}
+
+/* Orders a pair without branches */
+void sort_pair(inout Elem x, inout Elem y) {
+#ifdef VALUE_TYPE
+  bool swap = x.key > y.key;
+  Elem lo = swap ? y : x;
+  Elem hi = swap ? x : y;
+  x = lo;
+  y = hi;
+#else
+  TYPE lo = min(x.key, y.key);
+  TYPE hi = max(x.key, y.key);
+  x.key = lo;
+  y.key = hi;
+#endif
+}
+
+/* Index of the workgroup in the grid. Grids longer than
+ * maxComputeWorkGroupCount[0] are laid out in rows of GRID_WIDTH */
+uint workgroup_index() {
+  return gl_WorkGroupID.y * GRID_WIDTH + gl_WorkGroupID.x;
+}
+
+/* Index of the left element of the c-th comparator in the layer
+ * described by the stride parameters (see Sorter::record for their meaning).
+ * Comparators are numbered in the increasing order of their left
+ * elements, so only the live ones have to be launched */
+uint get_left_index(uint c, uint stride, uint stride_trailing_zeros,
+                    uint inner_reminder, uint inner_last_idx) {
+  /* Left elements are the ones of the even stride blocks */
+  if (inner_reminder == 0) {
+    return ((c >> stride_trailing_zeros) << (stride_trailing_zeros + 1)) |
+           (c & (stride - 1));
+  }
+  /* Left elements are the ones of the odd stride blocks
+   * except the last block of each merge group */
+  uint merge_group_size = (inner_last_idx + 1) << stride_trailing_zeros;
+  uint group_comparators = ((inner_last_idx - 1) >> 1)
+                           << stride_trailing_zeros;
+  uint group = c / group_comparators;
+  uint inner_c = c - group * group_comparators;
+  return group * merge_group_size + stride +
+         (((inner_c >> stride_trailing_zeros) << (stride_trailing_zeros + 1)) |
+          (inner_c & (stride - 1)));
+}
@@ -1,66 +1,703 @@
 #include "batcher_sort.h"
 #include "defs.h"
+#include "network.h"
 #include "shaders.h"
 #include "timer.h"
 #include "vk_util.h"
+#include <algorithm>
+#include <bit>
 #include <chrono>
 #include <cmath>
+#include <cstring>
 #include <iostream>
+#include <limits>
+#include <stdexcept>
 #include <string>
 
-void sort_vec(VkInfo* info) {
-    // Initialize sort shader */
-    create_shader(MERGE_SHADER, MERGE_SHADER_LEN, info);
+// Number of quads of the radix-4 kernel with at least one live comparator
+static uint32_t count_quads(uint32_t n, uint32_t merge_group_size) {
+    uint32_t quarter = merge_group_size / 4;
+    if (n <= 2 * quarter) {
+        return 0;
+    }
+    uint32_t u = n - 2 * quarter;
+    return u / merge_group_size * quarter +
+           std::min(u % merge_group_size, quarter);
+}
 
-    // Start queuing the sequence of commands
-    // to be executed on GPU
-    begin_command_buffer(info);
+// Fill the padding of the array with the maximal keys. When the maximal
+// key is a repeated 32-bit word the device buffer is filled directly,
+// otherwise the padding is prepared in the host buffer
+static void pad_input(KeyType key_type, SortInfo* info) {
+    switch (key_type) {
+    case U32:
+    case U64:
+        fill_padding(0xFFFFFFFF, info);
+        return;
+    case I32:
+        fill_padding(0x7FFFFFFF, info);
+        return;
+    case F32:
+        fill_padding(0x7F800000, info); // +inf
+        return;
+    default:
+        break;
+    }
+    visit_key_type(key_type, [&]<typename T>() {
+        T* buf = static_cast<T*>(info->arr.get_mapped());
+        std::fill(buf + info->arr.get_elements_num(),
+                  buf + info->arr.get_padded_elements_num(), sentinel<T>());
+    });
+    load_padding(info);
+}
+
+Sorter::Sorter(KeyType key_type, ValueType value_type, VkInfo* vk_info,
+               uint32_t recordings_capacity, uint32_t queue_index)
+    : key_type(key_type), value_type(value_type),
+      recordings_capacity(recordings_capacity) {
+    if (!supports_key_type(key_type, vk_info)) {
+        throw std::runtime_error(std::string("device doesn't support ") +
+                                 KEY_TYPE_NAMES[key_type] + " keys");
+    }
+
+    info.vk_info = vk_info;
+    if (queue_index >= vk_info->queues.size()) {
+        throw std::runtime_error("device has no such compute queue");
+    }
+    info.queue = vk_info->queues[queue_index];
+    info.spec_constants = vk_info->spec_constants;
+    uint32_t register_run = info.spec_constants.register_run;
+    if (register_run < 2 || register_run > 32 ||
+        (register_run & (register_run - 1)) != 0) {
+        throw std::runtime_error(
+            "register run must be a power of 2 between 2 and 32");
+    }
+    uint32_t tile_size = info.spec_constants.tile_size;
+    const auto& limits = vk_info->properties.limits;
+    if (tile_size == 0 || (tile_size & (tile_size - 1)) != 0 ||
+        tile_size > limits.maxComputeWorkGroupSize[0] ||
+        tile_size > limits.maxComputeWorkGroupInvocations) {
+        throw std::runtime_error(
+            "workgroup size must be a power of 2 within the device limits");
+    }
+    // Payloads share the block with their keys
+    size_t element_size =
+        KEY_TYPE_SIZES[key_type] + VALUE_TYPE_SIZES[value_type];
+    if (tile_size * register_run * element_size >
+        limits.maxComputeSharedMemorySize) {
+        throw std::runtime_error(
+            "workgroup's block doesn't fit into the shared memory");
+    }
+    // Bounds of the merge groups sorted by the local kernel are passed
+    // as push constants
+    if (tile_size * register_run > 1u << MAX_LOCAL_LEVELS) {
+        throw std::runtime_error("workgroup's block is too large");
+    }
+    // Chunks consist of whole blocks of the local kernel, the ones
+    // longer than any array are never used
+    uint64_t local_sort_size = tile_size * register_run;
+    uint64_t chunk_blocks =
+        (vk_info->chunk_size + local_sort_size - 1) / local_sort_size;
+    chunk_size = chunk_blocks * local_sort_size <= UINT32_MAX
+                     ? chunk_blocks * local_sort_size
+                     : 0;
+    if (recordings_capacity == 0) {
+        throw std::runtime_error("sorter has to keep at least one recording");
+    }
+
+    // Initialize sort shaders, they don't depend on the array
+    create_descriptor_pool(value_type == NoValue ? 1 : 2, recordings_capacity,
+                           &info);
+    create_command_pool(&info);
+    const ShaderCode& merge = MERGE_SHADERS[value_type][key_type];
+    create_shader(merge.data, merge.len, Merge, &info);
+    const ShaderCode& merge_radix4 = MERGE_RADIX4_SHADERS[value_type][key_type];
+    create_shader(merge_radix4.data, merge_radix4.len, MergeRadix4, &info);
+    // Lanes of a subgroup exchange their runs directly when the device
+    // allows it, otherwise the local kernel goes through shared memory
+    const ShaderCode& local_merge =
+        supports_subgroup_shuffles(tile_size, vk_info)
+            ? LOCAL_MERGE_SUBGROUP_SHADERS[value_type][key_type]
+            : LOCAL_MERGE_SHADERS[value_type][key_type];
+    create_shader(local_merge.data, local_merge.len, LocalMerge, &info);
+}
 
-    // Transfer the array to GPU
-    load_input(info);
-    put_write_read_barrier(Transfer, Shader, info);
+// The fences of the awaited sorts are signaled eventually, coroutines
+// never resumed are left suspended
+Sorter::~Sorter() {
+    if (fence_waiter.joinable()) {
+        {
+            std::lock_guard lock{awaiting_mutex};
+            stopping = true;
+        }
+        fences_queued.notify_one();
+        fence_waiter.join();
+    }
+    for (Recording& recording : recordings) {
+        release(recording);
+    }
+    destroy_sort_info(&info);
+}
 
-    // Get the size of the array
-    uint32_t n = info->arr.get_elements_num();
+void Sorter::check_types(KeyType key_type, ValueType value_type) const {
+    if (key_type != this->key_type || value_type != this->value_type) {
+        throw std::runtime_error("sorter is built for other types");
+    }
+}
+
+// The array has to fit in a storage buffer binding, and the merge
+// groups covering it are indexed by 32 bits in the kernels
+size_t Sorter::max_size() const {
+    const auto& limits = info.vk_info->properties.limits;
+    size_t element_size =
+        std::max(KEY_TYPE_SIZES[key_type], VALUE_TYPE_SIZES[value_type]);
+    size_t max_n = std::min<size_t>(
+        limits.maxStorageBufferRange / element_size, size_t(1) << 31);
+    // The padding rounds the array up to a power of 2
+    return info.spec_constants.padded ? std::bit_floor(max_n) : max_n;
+}
+
+SortFuture Sorter::submit(void* keys, void* values, size_t n) {
+    if (n > max_size()) {
+        throw std::runtime_error("array is too long for the device");
+    }
+    if (n < 2) {
+        return {};
+    }
+    uint32_t length = n;
+    std::vector<Ties> ties;
+    if (values != nullptr && info.spec_constants.padded &&
+        padded_size(length, &info) > length) {
+        save_ties(keys, values, 0, length, ties);
+    }
+    return submit({length, {}}, {{0, 0, length, length}}, std::move(ties),
+                  keys, values);
+}
+
+// The segments are laid out by lay_out_segments
+SortFuture Sorter::submit_segments(void* keys, void* values, size_t n,
+                                   std::span<const uint32_t> offsets) {
+    if (info.spec_constants.padded) {
+        throw std::runtime_error("segments can't be sorted with padding");
+    }
+    std::vector<Segment> segments;
+    Layout layout = lay_out_segments(offsets, n, max_size(), segments);
+    if (segments.empty()) {
+        return {};
+    }
+
+    std::vector<Ties> ties;
+    for (const Segment& segment : segments) {
+        if (values != nullptr && segment.length < segment.padded_length) {
+            save_ties(keys, values, segment.offset, segment.length, ties);
+        }
+    }
+
+    return submit(layout, std::move(segments), std::move(ties), keys, values);
+}
+
+void Sorter::save_ties(const void* keys, const void* values, size_t offset,
+                       uint32_t length, std::vector<Ties>& ties) const {
+    size_t value_size = VALUE_TYPE_SIZES[value_type];
+    visit_key_type(key_type, [&]<typename T>() {
+        const T* begin = static_cast<const T*>(keys) + offset;
+        Ties saved{offset + length, {}};
+        for (uint32_t i = 0; i < length; i++) {
+            if (begin[i] == sentinel<T>()) {
+                auto value = static_cast<const char*>(values) +
+                             (offset + i) * value_size;
+                saved.values.insert(saved.values.end(), value,
+                                    value + value_size);
+            }
+        }
+        if (!saved.values.empty()) {
+            ties.push_back(std::move(saved));
+        }
+    });
+}
+
+SortFuture Sorter::submit(const Layout& layout, std::vector<Segment> segments,
+                          std::vector<Ties> ties, void* keys, void* values) {
+    use_recording(layout);
+    Recording& recording = recordings.front();
+    recording.keys = keys;
+    recording.values = values;
+    recording.segments = std::move(segments);
+    recording.ties = std::move(ties);
+    if (!recording.chunks.empty()) {
+        submit_chunks(recording);
+        recording.in_flight = true;
+        recording.submission = ++submissions;
+        return {this, recording.submission};
+    }
+
+    size_t key_size = KEY_TYPE_SIZES[key_type];
+    size_t value_size = VALUE_TYPE_SIZES[value_type];
+    auto mapped = static_cast<char*>(info.arr.get_mapped());
+    auto values_mapped = static_cast<char*>(info.arr.get_values_mapped());
+    for (const Segment& segment : recording.segments) {
+        std::memcpy(mapped + segment.padded_offset * key_size,
+                    static_cast<char*>(keys) + segment.offset * key_size,
+                    segment.length * key_size);
+        if (info.arr.has_values()) {
+            std::memcpy(
+                values_mapped + segment.padded_offset * value_size,
+                static_cast<char*>(values) + segment.offset * value_size,
+                segment.length * value_size);
+        }
+    }
+    // Pad the segments of a batch
+    visit_key_type(key_type, [&]<typename T>() {
+        T* buf = static_cast<T*>(info.arr.get_mapped());
+        for (const Segment& segment : recording.segments) {
+            std::fill(buf + segment.padded_offset + segment.length,
+                      buf + segment.padded_offset + segment.padded_length,
+                      sentinel<T>());
+        }
+    });
+    // Submit the recorded sort, the results are copied back on completion
+    ::submit(&info);
+    recording.in_flight = true;
+    recording.submission = ++submissions;
+    return {this, recording.submission};
+}
+
+// Stream a plain array in chunks. The host copy of a chunk overlaps with
+// the upload of the previous one and the local sort of the one before,
+// the global layers start once all chunks are sorted locally. Downloads
+// are submitted per chunk, so the copies back to the caller's array
+// overlap with them in complete()
+void Sorter::submit_chunks(Recording& recording) {
+    VkInfo* vk_info = info.vk_info;
+    size_t key_size = KEY_TYPE_SIZES[key_type];
+    size_t value_size = VALUE_TYPE_SIZES[value_type];
+    auto mapped = static_cast<char*>(info.arr.get_mapped());
+    auto values_mapped = static_cast<char*>(info.arr.get_values_mapped());
+    uint32_t n = recording.layout.n;
+    std::vector<VkSemaphore> sorted;
+    for (size_t k = 0; k < recording.chunks.size(); k++) {
+        const Chunk& chunk = recording.chunks[k];
+        size_t first = k * chunk_size;
+        size_t count = std::min<size_t>(chunk_size, n - first);
+        std::memcpy(mapped + first * key_size,
+                    static_cast<char*>(recording.keys) + first * key_size,
+                    count * key_size);
+        if (info.arr.has_values()) {
+            std::memcpy(values_mapped + first * value_size,
+                        static_cast<char*>(recording.values) +
+                            first * value_size,
+                        count * value_size);
+        }
+        info.command_buffer = chunk.upload;
+        ::submit(vk_info->transfer_queue, VK_NULL_HANDLE, {chunk.uploaded},
+                 VK_NULL_HANDLE, &info);
+        info.command_buffer = chunk.sort;
+        ::submit(info.queue, chunk.uploaded, {}, VK_NULL_HANDLE, &info);
+        sorted.push_back(chunk.sorted);
+    }
+    info.command_buffer = recording.command_buffer;
+    ::submit(info.queue, VK_NULL_HANDLE, sorted, info.fence, &info);
+    for (const Chunk& chunk : recording.chunks) {
+        info.command_buffer = chunk.download;
+        ::submit(vk_info->transfer_queue, chunk.sorted, {}, chunk.downloaded,
+                 &info);
+    }
+    info.command_buffer = recording.command_buffer;
+}
+
+// The recording of the submission if it's still in flight
+Sorter::Recording* Sorter::find_submission(uint64_t submission) {
+    for (Recording& recording : recordings) {
+        if (recording.in_flight && recording.submission == submission) {
+            return &recording;
+        }
+    }
+    return nullptr;
+}
+
+// Whether the device has finished the submission of the recording
+bool Sorter::finished(const Recording& recording) {
+    for (const Chunk& chunk : recording.chunks) {
+        if (!fence_signaled(chunk.downloaded, info.vk_info)) {
+            return false;
+        }
+    }
+    return fence_signaled(recording.fence, info.vk_info);
+}
+
+void Sorter::complete(Recording& recording) {
+    if (!recording.in_flight) {
+        return;
+    }
+    size_t key_size = KEY_TYPE_SIZES[key_type];
+    size_t value_size = VALUE_TYPE_SIZES[value_type];
+    auto mapped = static_cast<char*>(recording.arr.get_mapped());
+    auto values_mapped = static_cast<char*>(recording.arr.get_values_mapped());
+    // Chunks are copied back as soon as they are downloaded
+    for (size_t k = 0; k < recording.chunks.size(); k++) {
+        wait_fence(recording.chunks[k].downloaded, info.vk_info);
+        size_t first = k * chunk_size;
+        size_t count = std::min<size_t>(chunk_size, recording.layout.n - first);
+        std::memcpy(static_cast<char*>(recording.keys) + first * key_size,
+                    mapped + first * key_size, count * key_size);
+        if (recording.arr.has_values()) {
+            std::memcpy(static_cast<char*>(recording.values) +
+                            first * value_size,
+                        values_mapped + first * value_size,
+                        count * value_size);
+        }
+    }
+    if (recording.chunks.empty()) {
+        wait_fence(recording.fence, info.vk_info);
+        for (const Segment& segment : recording.segments) {
+            std::memcpy(static_cast<char*>(recording.keys) +
+                            segment.offset * key_size,
+                        mapped + segment.padded_offset * key_size,
+                        segment.length * key_size);
+            if (recording.arr.has_values()) {
+                std::memcpy(static_cast<char*>(recording.values) +
+                                segment.offset * value_size,
+                            values_mapped + segment.padded_offset * value_size,
+                            segment.length * value_size);
+            }
+        }
+    }
+    // The maximal keys are sorted last in their parts
+    for (const Ties& saved : recording.ties) {
+        std::memcpy(static_cast<char*>(recording.values) +
+                        saved.end * value_size - saved.values.size(),
+                    saved.values.data(), saved.values.size());
+    }
+    recording.in_flight = false;
+}
+
+// Make the recording for arrays of the layout current, the least recently
+// used one is evicted when a new layout doesn't fit. Everything but the
+// pipelines is created anew for a new layout
+void Sorter::use_recording(const Layout& layout) {
+    auto it = recordings_by_layout.find(layout);
+    if (it != recordings_by_layout.end()) {
+        recordings.splice(recordings.begin(), recordings, it->second);
+        wait_fence_released(recordings.front().fence);
+        complete(recordings.front());
+        make_current(recordings.front());
+        return;
+    }
+
+    if (recordings.size() == recordings_capacity) {
+        release(recordings.back());
+        recordings_by_layout.erase(recordings.back().layout);
+        recordings.pop_back();
+    }
+    uint32_t n = layout.n;
+    uint32_t padded_n = info.spec_constants.padded ? padded_size(n, &info) : n;
+    info.arr = create_array_storage(n, KEY_TYPE_SIZES[key_type],
+                                    VALUE_TYPE_SIZES[value_type], padded_n,
+                                    info.vk_info);
+    allocate_descriptor_set(&info);
+    write_descriptor_set(&info);
+    // Plain arrays longer than a chunk are streamed unless there is
+    // nothing to transfer
+    std::vector<Chunk> chunks;
+    if (chunk_size != 0 && layout.bounds.empty() && n > chunk_size &&
+        !info.arr.is_unified()) {
+        chunks.resize((n + chunk_size - 1) / chunk_size);
+        for (Chunk& chunk : chunks) {
+            allocate_transfer_command_buffer(&info);
+            chunk.upload = info.command_buffer;
+            allocate_command_buffer(&info);
+            chunk.sort = info.command_buffer;
+            allocate_transfer_command_buffer(&info);
+            chunk.download = info.command_buffer;
+            chunk.uploaded = create_semaphore(info.vk_info);
+            chunk.sorted = create_semaphore(info.vk_info);
+            create_fence(&info);
+            chunk.downloaded = info.fence;
+        }
+    }
+    allocate_command_buffer(&info);
+    create_fence(&info);
+    record(layout, chunks);
+    recordings.push_front({
+        .layout = layout,
+        .arr = info.arr,
+        .descriptor_set = info.descriptor_set,
+        .command_buffer = info.command_buffer,
+        .fence = info.fence,
+        .chunks = std::move(chunks),
+    });
+    recordings_by_layout[layout] = recordings.begin();
+}
+
+void Sorter::make_current(const Recording& recording) {
+    info.arr = recording.arr;
+    info.descriptor_set = recording.descriptor_set;
+    info.command_buffer = recording.command_buffer;
+    info.fence = recording.fence;
+}
+
+void Sorter::release(Recording& recording) {
+    wait_fence_released(recording.fence);
+    complete(recording);
+    for (const Chunk& chunk : recording.chunks) {
+        info.command_buffer = chunk.upload;
+        free_transfer_command_buffer(&info);
+        info.command_buffer = chunk.sort;
+        free_command_buffer(&info);
+        info.command_buffer = chunk.download;
+        free_transfer_command_buffer(&info);
+        destroy_semaphore(chunk.uploaded, info.vk_info);
+        destroy_semaphore(chunk.sorted, info.vk_info);
+        info.fence = chunk.downloaded;
+        destroy_fence(&info);
+    }
+    make_current(recording);
+    destroy_fence(&info);
+    free_command_buffer(&info);
+    free_descriptor_set(&info);
+    destroy_array_storage(recording.arr, info.vk_info);
+}
+
+// Record the whole sort of the current array: the transfers from and
+// back to the host buffers with the layers of the network in between.
+// For a streamed array the transfers and the local sort are recorded
+// per chunk instead
+void Sorter::record(const Layout& layout, const std::vector<Chunk>& chunks) {
+    SortInfo* info = &this->info;
+    uint32_t register_run = info->spec_constants.register_run;
+    uint32_t tile_size = info->spec_constants.tile_size;
+    bool padded = info->spec_constants.padded;
+    VkCommandBuffer command_buffer = info->command_buffer;
+
+    // Get the size of the array, the padded array is sorted as a whole
+    uint32_t n = padded ? info->arr.get_padded_elements_num()
+                        : info->arr.get_elements_num();
 
     // Set the upper power of 2 as an imaginative size
-    // (real bounds are checked inside the shader)
+    // (real bounds are checked inside the shader). A batch is sorted
+    // up to its longest segment, merge groups of each size are applied
+    // only to the segments of at least that size
     uint32_t N = 1;
     while (N < n) {
         N *= 2;
     }
+    bool segmented = !layout.bounds.empty();
+    if (segmented) {
+        N = 1u << layout.bounds.size();
+    }
+    auto bound = [&](uint32_t merge_group_size) {
+        return segmented ? layout.bounds[__builtin_ctz(merge_group_size) - 1]
+                         : n;
+    };
+
+    // Merge groups that fit in a workgroup's shared memory block
+    // are all sorted by a single dispatch, the ones inside
+    // an invocation's run are sorted in registers
+    uint32_t local_sort_size = tile_size * register_run;
+    uint32_t local_merge_group_size = std::min(N, local_sort_size);
+    std::vector<push_cst_t> local_push_csts = {n, local_merge_group_size, 0};
+    for (uint32_t l = 0; l < MAX_LOCAL_LEVELS; l++) {
+        uint32_t merge_group_size = 2u << l;
+        local_push_csts.push_back(merge_group_size <= local_merge_group_size
+                                      ? bound(merge_group_size)
+                                      : 0);
+    }
+
+    for (size_t k = 0; k < chunks.size(); k++) {
+        uint32_t first = k * chunk_size;
+        uint32_t count =
+            std::min(chunk_size, info->arr.get_elements_num() - first);
+        info->command_buffer = chunks[k].upload;
+        begin_command_buffer(info);
+        load_input(first, count, info);
+        end_command_buffer(info);
+
+        // The blocks wholly inside the padding are sorted already
+        info->command_buffer = chunks[k].sort;
+        begin_command_buffer(info);
+        if (padded && k == 0) {
+            pad_input(key_type, info);
+        }
+        put_write_read_barrier(Transfer, Shader, info);
+        local_push_csts[2] = first / local_sort_size;
+        bind_constants(local_push_csts, info);
+        dispatch(count, local_sort_size, LocalMerge, info);
+        end_command_buffer(info);
+
+        info->command_buffer = chunks[k].download;
+        begin_command_buffer(info);
+        load_output(first, count, info);
+        end_command_buffer(info);
+    }
+    info->command_buffer = command_buffer;
+
+    // Start queuing the sequence of commands
+    // to be executed on GPU
+    begin_command_buffer(info);
+    if (chunks.empty()) {
+        // Transfer the array to GPU
+        load_input(info);
+        if (padded) {
+            pad_input(key_type, info);
+        }
+        put_write_read_barrier(Transfer, Shader, info);
+        bind_constants(local_push_csts, info);
+        dispatch(n, local_sort_size, LocalMerge, info);
+    }
+    put_write_read_barrier(Shader, Shader, info);
 
-    uint32_t merge_group_size = 2;
+    // The rest of layers go through the global memory one by one.
+    // For odd-even merge the layers with small strides can't be
+    // fused the same way: their comparators cross block boundaries
+    uint32_t merge_group_size = local_merge_group_size << 1;
     while (merge_group_size <= N) {
-        uint32_t inner_rem = 0;
-        for (uint32_t stride = merge_group_size >> 1; stride >= 1;
+        uint32_t group_bound = bound(merge_group_size);
+        // The first two layers of a merge group split into independent
+        // quads and are applied by a single pass
+        uint32_t quarter = merge_group_size >> 2;
+        bind_constants(
+            {group_bound, quarter, uint32_t(__builtin_ctz(quarter))}, info);
+        dispatch(count_quads(group_bound, merge_group_size), tile_size,
+                 MergeRadix4, info);
+        put_write_read_barrier(Shader, Shader, info);
+
+        // The rest of layers have odd inner indices on the left
+        uint32_t inner_rem = 1;
+        for (uint32_t stride = merge_group_size >> 3; stride >= 1;
              stride >>= 1) {
             uint32_t stride_trailing_zeros = __builtin_ctz(stride);
             uint32_t inner_last_idx =
                 (merge_group_size >> stride_trailing_zeros) - 1;
-            std::vector<push_cst_t> push_csts = {n,                     //
+            std::vector<push_cst_t> push_csts = {group_bound,           //
                                                  stride,                //
                                                  stride_trailing_zeros, //
                                                  inner_rem,             //
                                                  inner_last_idx};
             bind_constants(push_csts, info);
-            // Queue a merge layer
-            dispatch(n, TILE_SIZE, info);
+            // Queue a merge layer, one invocation per comparator
+            dispatch(count_comparators(group_bound, merge_group_size, stride,
+                                       inner_rem),
+                     tile_size, Merge, info);
             put_write_read_barrier(Shader, Shader, info);
-
-            // Starting from the second iteration, inner index
-            // should be odd to be the left one
-            inner_rem = 1;
         }
         merge_group_size <<= 1;
     }
-    put_write_read_barrier(Shader, Transfer, info);
-
-    // Transfer array back grom GPU
-    load_output(info);
+    // Transfer array back grom GPU, streamed arrays are downloaded
+    // by their chunks after the semaphores. Unified storage is read
+    // by the host in place
+    if (info->arr.is_unified()) {
+        put_write_read_barrier(Shader, Host, info);
+    } else if (chunks.empty()) {
+        put_write_read_barrier(Shader, Transfer, info);
+        load_output(info);
+    }
 
     // Mark the end of the buffer,
     end_command_buffer(info);
-    // Submit it and wait until it's computed
-    submit(info);
+}
+
+// The waiting thread is started by the first awaited future
+void Sorter::await_fence(VkFence fence, std::coroutine_handle<> handle) {
+    std::lock_guard lock{awaiting_mutex};
+    awaiting++;
+    awaited_fences.emplace_back(fence, handle);
+    if (!fence_waiter.joinable()) {
+        fence_waiter = std::thread([this] { wait_fences(); });
+    }
+    fences_queued.notify_one();
+}
+
+// Body of the waiting thread: the queued fences are waited for in turn,
+// it stops once the sorter is destroyed and none is left
+void Sorter::wait_fences() {
+    std::unique_lock lock{awaiting_mutex};
+    while (true) {
+        fences_queued.wait(
+            lock, [this] { return stopping || !awaited_fences.empty(); });
+        if (awaited_fences.empty()) {
+            return;
+        }
+        auto [fence, handle] = awaited_fences.front();
+        lock.unlock();
+        wait_fence(fence, info.vk_info);
+        lock.lock();
+        awaited_fences.pop_front();
+        resumable.push_back(handle);
+        awaiting_ready.notify_all();
+    }
+}
+
+// The next submission of a recording resets its fence and the release
+// destroys it, neither may happen while the waiting thread still has it
+void Sorter::wait_fence_released(VkFence fence) {
+    std::unique_lock lock{awaiting_mutex};
+    awaiting_ready.wait(lock, [&] {
+        return std::none_of(
+            awaited_fences.begin(), awaited_fences.end(),
+            [&](const auto& awaited) { return awaited.first == fence; });
+    });
+}
+
+// A resumed coroutine may await another future, which is counted before
+// it suspends, so the loop ends only once all of them are done
+void Sorter::resume_awaiting() {
+    std::unique_lock lock{awaiting_mutex};
+    while (awaiting > 0) {
+        awaiting_ready.wait(lock, [this] { return !resumable.empty(); });
+        std::vector<std::coroutine_handle<>> handles;
+        std::swap(handles, resumable);
+        awaiting -= handles.size();
+        lock.unlock();
+        for (std::coroutine_handle<> handle : handles) {
+            handle.resume();
+        }
+        lock.lock();
+    }
+}
+
+SortFuture::SortFuture(SortFuture&& other)
+    : sorter(other.sorter), submission(other.submission) {
+    other.sorter = nullptr;
+}
+
+SortFuture& SortFuture::operator=(SortFuture&& other) {
+    if (this != &other) {
+        wait();
+        sorter = other.sorter;
+        submission = other.submission;
+        other.sorter = nullptr;
+    }
+    return *this;
+}
+
+SortFuture::~SortFuture() { wait(); }
+
+bool SortFuture::ready() const {
+    if (sorter == nullptr) {
+        return true;
+    }
+    auto recording = sorter->find_submission(submission);
+    return recording == nullptr || sorter->finished(*recording);
+}
+
+void SortFuture::wait() {
+    if (sorter == nullptr) {
+        return;
+    }
+    // The recording is gone or reused only after it has been completed
+    auto recording = sorter->find_submission(submission);
+    if (recording != nullptr) {
+        sorter->complete(*recording);
+    }
+    sorter = nullptr;
+}
+
+VkFence SortFuture::fence() const {
+    auto recording =
+        sorter == nullptr ? nullptr : sorter->find_submission(submission);
+    return recording == nullptr ? VK_NULL_HANDLE : recording->fence;
+}
+
+void SortFuture::suspend(VkFence fence, std::coroutine_handle<> handle) {
+    sorter->await_fence(fence, handle);
 }
@@ -0,0 +1,20 @@
+#include "cpu_sorter.h"
+#include <unistd.h>
+
+// Half of the L2 cache, the rest is left for the other data. Without
+// the cache sizes reported the L2 is assumed to have 256 KiB
+static size_t default_tile_bytes() {
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    long size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (size > 0) {
+        return size / 2;
+    }
+#endif
+    return 128 << 10;
+}
+
+CpuSorter::CpuSorter(uint32_t threads, size_t tile_bytes,
+                     CpuSchedule schedule)
+    : pool(threads),
+      tile_bytes(tile_bytes != 0 ? tile_bytes : default_tile_bytes()),
+      schedule(schedule) {}
@@ -0,0 +1,38 @@
+#include "free_ranges.h"
+#include <iterator>
+
+FreeRanges::FreeRanges(uint64_t size) {
+    if (size > 0) {
+        ranges[0] = size;
+    }
+}
+
+std::optional<FreeRanges::Range> FreeRanges::take(uint64_t size,
+                                                  uint64_t alignment) {
+    for (auto [start, free] : ranges) {
+        uint64_t offset = (start + alignment - 1) / alignment * alignment;
+        if (offset + size <= start + free) {
+            ranges.erase(start);
+            if (offset + size < start + free) {
+                ranges[offset + size] = start + free - offset - size;
+            }
+            return Range{start, offset, offset + size - start};
+        }
+    }
+    return std::nullopt;
+}
+
+void FreeRanges::give(uint64_t start, uint64_t size) {
+    uint64_t end = start + size;
+    auto next = ranges.lower_bound(start);
+    if (next != ranges.end() && next->first == end) {
+        end += next->second;
+        next = ranges.erase(next);
+    }
+    if (next != ranges.begin() &&
+        std::prev(next)->first + std::prev(next)->second == start) {
+        start = std::prev(next)->first;
+        ranges.erase(std::prev(next));
+    }
+    ranges[start] = end - start;
+}
@@ -0,0 +1,61 @@
+#include "hybrid_sorter.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+// The devices' share can't go below this, so that both sides keep
+// being measured
+constexpr double MIN_SHARE = 1.0 / 16;
+
+// Shorter arrays take about the latency of a submission on the devices
+// whatever their share, so they don't move it
+constexpr size_t MIN_CALIBRATION_SIZE = 1 << 20;
+
+// The share depends on the devices, the types and the CPU threads
+HybridSorter::HybridSorter(KeyType key_type, ValueType value_type,
+                           const std::vector<VkInfo*>& infos,
+                           uint32_t threads, CpuSchedule schedule,
+                           const std::string& cache_dir)
+    : device_sorter(key_type, value_type, infos),
+      cpu_sorter(threads, 0, schedule) {
+    if (cache_dir.empty()) {
+        return;
+    }
+    std::ostringstream path;
+    path << cache_dir << "/split-" << std::hex;
+    for (VkInfo* info : infos) {
+        path << info->properties.vendorID << "-"
+             << info->properties.deviceID << "-";
+    }
+    path << KEY_TYPE_NAMES[key_type] << "-v"
+         << std::dec << VALUE_TYPE_SIZES[value_type] * 8 << "-t"
+         << cpu_sorter.threads() << "-" << CPU_SCHEDULE_NAMES[schedule]
+         << ".txt";
+    share_path = path.str();
+
+    std::ifstream file(share_path);
+    double saved;
+    if (file >> saved && saved >= MIN_SHARE && saved <= 1 - MIN_SHARE) {
+        share = saved;
+    }
+}
+
+HybridSorter::~HybridSorter() {
+    if (!share_path.empty()) {
+        std::ostringstream data;
+        data << share << std::endl;
+        replace_file(share_path, data.str(), "the split ratio");
+    }
+}
+
+void HybridSorter::calibrate(size_t device_keys, double device_time,
+                             size_t cpu_keys, double cpu_time) {
+    if (device_keys + cpu_keys < MIN_CALIBRATION_SIZE || device_keys == 0 ||
+        cpu_keys == 0 || device_time <= 0 || cpu_time <= 0) {
+        return;
+    }
+    double device_rate = device_keys / device_time;
+    double cpu_rate = cpu_keys / cpu_time;
+    double balanced = device_rate / (device_rate + cpu_rate);
+    share = std::clamp((share + balanced) / 2, MIN_SHARE, 1 - MIN_SHARE);
+}
@@ -1,36 +1,265 @@
 #include "batcher_sort.h"
+#include "cpu_sorter.h"
+#include "hybrid_sorter.h"
+#include "key_type.h"
+#include "multi_sorter.h"
 #include "opts.h"
 #include "timer.h"
+#include <numeric>
+#include <optional>
+#include <random>
+#include <thread>
 
-int main(int argc, char* argv[]) {
-    auto opts = Options::parse(argc, argv);
+// Payloads are the original positions of the keys, so the sorted
+// payloads have to be a permutation leading back to the sorted keys
+template <typename T, typename V>
+static bool check_values(const std::vector<T>& keys,
+                         const std::vector<T>& original, const V* values) {
+    std::vector<bool> seen(keys.size());
+    for (size_t k = 0; k < keys.size(); k++) {
+        if (values[k] >= keys.size() || seen[values[k]] ||
+            original[values[k]] != keys[k]) {
+            return false;
+        }
+        seen[values[k]] = true;
+    }
+    return true;
+}
+
+// Offsets of the given number of segments splitting an array at random
+// positions, a single segment covers the whole array
+static std::vector<uint32_t> split_segments(uint32_t n, uint32_t segments,
+                                            uint32_t seed) {
+    std::vector<uint32_t> offsets = {0};
+    std::mt19937 gen{seed};
+    std::uniform_int_distribution<uint32_t> dist{0, n};
+    for (uint32_t k = 1; k < segments; k++) {
+        offsets.push_back(dist(gen));
+    }
+    offsets.push_back(n);
+    std::sort(offsets.begin(), offsets.end());
+    return offsets;
+}
+
+// Cold creation doesn't use the pipeline cache, warm creation uses it
+// after it has been filled by the file or by a previous creation.
+// Drivers can have caches of their own, which this doesn't control
+static void report_pipeline_times(const Options& opts, VkInfo* info) {
+    VkPipelineCache pipeline_cache = info->pipeline_cache;
+    info->pipeline_cache = VK_NULL_HANDLE;
+    Timer{"Cold pipeline creation: "}.run([&] { //
+        Sorter{opts.key_type, opts.value_type, info};
+    });
+    info->pipeline_cache = pipeline_cache;
+    Sorter{opts.key_type, opts.value_type, info};
+    Timer{"Warm pipeline creation: "}.run([&] { //
+        Sorter{opts.key_type, opts.value_type, info};
+    });
+}
+
+// Sorts copies of the same keys on the CPU with each schedule, doubling
+// the threads up to the requested ones
+template <typename T> static void report_scaling(const Options& opts) {
+    std::vector<T> keys(opts.n);
+    Array<T>{opts.n, keys.data()}.fill_random(opts.seed);
+    uint32_t max_threads = opts.threads;
+    if (max_threads == 0) {
+        max_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (uint32_t threads = 1;; threads = std::min(2 * threads, max_threads)) {
+        for (CpuSchedule schedule : {Barriers, Dataflow}) {
+            CpuSorter cpu_sorter{threads, 0, schedule};
+            std::vector<T> sorted = keys;
+            Timer{std::string{CPU_SCHEDULE_NAMES[schedule]} + " on " +
+                  std::to_string(threads) + " threads:"}
+                .run([&] { cpu_sorter.sort(std::span{sorted}); });
+            if (!std::is_sorted(sorted.begin(), sorted.end())) {
+                throw std::runtime_error("CPU network result isn't sorted");
+            }
+        }
+        if (threads == max_threads) {
+            break;
+        }
+    }
+}
 
-    auto guard = VkInfoGuard{};
-    auto info = guard.get();
+template <typename T, typename V>
+static void run(const Options& opts, const std::vector<VkInfo*>& infos) {
+    constexpr bool has_values = !std::is_void_v<V>;
+    // The kernels are built once, only the sort itself is timed.
+    // Arrays too long for the device are sorted in parts as well.
+    // Without devices the network runs on the CPU's threads
+    std::optional<CpuSorter> cpu_sorter;
+    std::optional<HybridSorter> hybrid_sorter;
+    std::optional<Sorter> sorter;
+    std::optional<MultiSorter> multi_sorter;
+    if (infos.empty()) {
+        cpu_sorter.emplace(opts.threads, 0, opts.schedule);
+        std::cout << "Sorting on " << cpu_sorter->threads()
+                  << " CPU threads with " << SIMD_LEVEL_NAMES[simd_level()]
+                  << " kernels, " << CPU_SCHEDULE_NAMES[opts.schedule]
+                  << " schedule" << std::endl;
+    } else if (opts.hybrid) {
+        hybrid_sorter.emplace(key_type_of<T>(), opts.value_type, infos,
+                              opts.threads, opts.schedule,
+                              opts.split_cache_dir);
+        std::cout << "Sorting on " << hybrid_sorter->queues() << " queues of "
+                  << infos.size() << " devices and "
+                  << hybrid_sorter->threads() << " CPU threads, "
+                  << hybrid_sorter->device_share() * 100
+                  << "% on the devices" << std::endl;
+    } else if (!opts.multi) {
+        sorter.emplace(key_type_of<T>(), opts.value_type, infos[0]);
+    }
+    // Segments are batched on a single device only
+    if (sorter && opts.n > sorter->max_size() && opts.segments > 1) {
+        throw std::runtime_error("array is too long for a batch of segments");
+    }
+    if (!infos.empty() && !hybrid_sorter &&
+        (opts.multi || opts.n > sorter->max_size())) {
+        sorter.reset();
+        multi_sorter.emplace(key_type_of<T>(), opts.value_type, infos);
+        std::cout << "Sorting on " << multi_sorter->size() << " queues of "
+                  << infos.size() << " devices" << std::endl;
+    }
 
-    // prepare an array storage
-    info->arr = create_array_storage(opts.n, info);
-    info->arr.fill_random(opts.seed);
+    std::vector<T> keys(opts.n);
+    Array<T> arr{opts.n, keys.data()};
+    arr.fill_random(opts.seed);
 
     // Create a copy of the array for CPU to sort for
     // benchmark comparison and verifying correctness
-    std::vector<CTYPE> arr_cpu(opts.n);
-    std::copy_n(info->arr.get_buffer(), opts.n, arr_cpu.data());
+    std::vector<T> arr_cpu = keys;
+    std::vector<T> original;
+    std::vector<std::conditional_t<has_values, V, uint32_t>> values;
+    if constexpr (has_values) {
+        values.resize(opts.n);
+        std::iota(values.begin(), values.end(), V{0});
+        original = keys;
+    }
+
+    // A single segment is sorted as a plain array
+    bool segmented = opts.segments > 1;
+    std::vector<uint32_t> offsets;
+    if (segmented) {
+        offsets = split_segments(opts.n, opts.segments, opts.seed);
+    }
 
     if (opts.debug)
-        info->arr.debug_print(opts.n);
-    Timer{"GPU time difference: "}.run([&] { //
-        sort_vec(info);
+        arr.debug_print(opts.n);
+    std::string label = cpu_sorter      ? "CPU network time difference: "
+                        : hybrid_sorter ? "Hybrid time difference: "
+                                        : "GPU time difference: ";
+    Timer{std::move(label)}.run([&] {
+        if constexpr (has_values) {
+            if (cpu_sorter) {
+                cpu_sorter->sort(std::span{keys}, std::span{values});
+            } else if (hybrid_sorter) {
+                hybrid_sorter->sort(std::span{keys}, std::span{values});
+            } else if (multi_sorter) {
+                multi_sorter->sort(std::span{keys}, std::span{values});
+            } else if (segmented) {
+                sorter->sort_segments(std::span{keys}, std::span{values},
+                                      std::span<const uint32_t>{offsets});
+            } else {
+                sorter->sort(std::span{keys}, std::span{values});
+            }
+        } else {
+            if (cpu_sorter) {
+                cpu_sorter->sort(std::span{keys});
+            } else if (hybrid_sorter) {
+                hybrid_sorter->sort(std::span{keys});
+            } else if (multi_sorter) {
+                multi_sorter->sort(std::span{keys});
+            } else if (segmented) {
+                sorter->sort_segments(std::span{keys},
+                                      std::span<const uint32_t>{offsets});
+            } else {
+                sorter->sort(std::span{keys});
+            }
+        }
     });
     if (opts.debug)
-        info->arr.debug_print(opts.n);
+        arr.debug_print(opts.n);
 
-    Timer{"CPU time difference: "}.run([&] { //
-        std::sort(std::begin(arr_cpu), std::end(arr_cpu));
+    Timer{"CPU time difference: "}.run([&] {
+        if (!segmented) {
+            std::sort(arr_cpu.begin(), arr_cpu.end());
+        }
+        for (size_t k = 0; k + 1 < offsets.size(); k++) {
+            std::sort(arr_cpu.begin() + offsets[k],
+                      arr_cpu.begin() + offsets[k + 1]);
+        }
     });
 
-    if (!info->arr.compare_with_reference(arr_cpu)) {
+    if (!arr.compare_with_reference(arr_cpu)) {
         throw std::runtime_error("GPU and CPU results differ");
     }
+    if constexpr (has_values) {
+        if (!check_values(arr_cpu, original, values.data())) {
+            throw std::runtime_error("GPU payloads don't follow their keys");
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    auto opts = Options::parse(argc, argv);
+    if (opts.list_devices) {
+        list_devices(std::cout);
+        return 0;
+    }
+
+    if (opts.scaling) {
+        visit_key_type(opts.key_type,
+                       [&]<typename T>() { report_scaling<T>(opts); });
+        return 0;
+    }
+
+    if ((opts.multi || opts.hybrid) && opts.segments > 1) {
+        throw std::runtime_error("segments aren't split across devices");
+    }
+    // Segment offsets and the payloads numbering the keys are 32-bit
+    if (opts.n > UINT32_MAX &&
+        (opts.segments > 1 || opts.value_type == V32)) {
+        throw std::runtime_error("array is too long for 32-bit offsets");
+    }
+
+    // Auto falls back to the CPU when there is no driver or no device
+    std::optional<VkDevicesGuard> guard;
+    if (opts.backend != Cpu) {
+        try {
+            guard.emplace(opts.multi, opts.device);
+        } catch (const std::runtime_error& e) {
+            if (opts.backend == Vulkan) {
+                throw;
+            }
+            std::cout << "No usable Vulkan device (" << e.what()
+                      << "), sorting on the CPU" << std::endl;
+        }
+    }
+    std::vector<VkInfo*> infos = guard ? guard->get() : std::vector<VkInfo*>{};
+    if (infos.empty() && opts.segments > 1) {
+        throw std::runtime_error("segments are sorted on Vulkan devices only");
+    }
+    for (VkInfo* info : infos) {
+        info->spec_constants.register_run = opts.register_run;
+        if (opts.tile_size != 0) {
+            info->spec_constants.tile_size = opts.tile_size;
+        }
+        info->spec_constants.padded = opts.padded;
+        info->chunk_size = opts.chunk_size;
+        if (opts.staging) {
+            info->unified_memory = false;
+        }
+        create_pipeline_cache(opts.pipeline_cache_dir, info);
+    }
+    if (opts.pipeline_times && !infos.empty()) {
+        report_pipeline_times(opts, infos[0]);
+    }
+
+    visit_key_type(opts.key_type, [&]<typename T>() {
+        visit_value_type(opts.value_type,
+                         [&]<typename V>() { run<T, V>(opts, infos); });
+    });
     return 0;
 }
@@ -0,0 +1,20 @@
+#include "multi_sorter.h"
+
+// A sorter per compute queue of every device, the parts are assigned
+// to the devices in turn so that a short array still spreads over them
+MultiSorter::MultiSorter(KeyType key_type, ValueType value_type,
+                         const std::vector<VkInfo*>& infos) {
+    size_t max_queues = 0;
+    for (VkInfo* info : infos) {
+        max_queues = std::max(max_queues, info->queues.size());
+    }
+    for (size_t queue = 0; queue < max_queues; queue++) {
+        for (VkInfo* info : infos) {
+            if (queue < info->queues.size()) {
+                sorters.push_back(std::make_unique<Sorter>(
+                    key_type, value_type, info, DEFAULT_RECORDINGS_CAPACITY,
+                    queue));
+            }
+        }
+    }
+}
@@ -1,15 +1,94 @@
 #include "opts.h"
 #include "cxxopts.h"
+#include "defs.h"
 #include <cstdint>
+#include <stdexcept>
+#include <string>
+
+static Backend parse_backend(const std::string& name) {
+    if (name == "vulkan") {
+        return Vulkan;
+    }
+    if (name == "cpu") {
+        return Cpu;
+    }
+    if (name == "auto") {
+        return Auto;
+    }
+    throw std::runtime_error("unknown backend " + name);
+}
+
+static CpuSchedule parse_schedule(const std::string& name) {
+    if (name == "barriers") {
+        return Barriers;
+    }
+    if (name == "dataflow") {
+        return Dataflow;
+    }
+    throw std::runtime_error("unknown schedule " + name);
+}
 
 Options Options::parse(int argc, char** argv) {
     cxxopts::Options options("batcher_sort",
-                             "Sort an array of integers on GPU and CPU");
-    options.add_options()("n", "Array length",
-                          cxxopts::value<uint32_t>()) //
+                             "Sort an array of keys on GPU and CPU");
+    options.add_options()(
+        "n",
+        "Array length. A device sorts at most 2^31 keys at once, longer "
+        "arrays are split between several sorters and merged on the host",
+        cxxopts::value<uint64_t>()) //
         ("s,seed", "Random seed",
          cxxopts::value<uint32_t>()->default_value("0")) //
-        ("d,debug", "Print initial and sorted array")    //
+        ("r,register-run",
+         "Number of contiguous elements sorted in registers by an invocation",
+         cxxopts::value<uint32_t>()->default_value(
+             std::to_string(REGISTER_RUN)))           //
+        ("w,workgroup-size",
+         "Invocations per workgroup, 0 picks it for the device",
+         cxxopts::value<uint32_t>()->default_value("0")) //
+        ("t,type", "Key type: u32, i32, u64, i64, f32 or f64",
+         cxxopts::value<std::string>()->default_value("f32")) //
+        ("v,values",
+         "Width of the payload carried with every key: 0, 32 or 64",
+         cxxopts::value<uint32_t>()->default_value("0")) //
+        ("p,padded", "Pad the array with the maximal keys to a power of 2") //
+        ("g,segments",
+         "Split the array into segments of random lengths sorted as a batch",
+         cxxopts::value<uint32_t>()->default_value("1")) //
+        ("c,chunk-size",
+         "Stream arrays in chunks of this many elements overlapping "
+         "transfers with sorting, 0 transfers them whole",
+         cxxopts::value<uint32_t>()->default_value("0")) //
+        ("staging",
+         "Copy through staging buffers even if the device shares the "
+         "memory with the host") //
+        ("m,multi",
+         "Split the array across every device and compute queue") //
+        ("hybrid",
+         "Sort a part of the array on the devices and the rest on the CPU "
+         "threads, split by their throughput in the previous runs") //
+        ("split-cache", "Directory to keep the hybrid split ratios in",
+         cxxopts::value<std::string>()->default_value("")) //
+        ("device", "Index of the device to sort on, -1 picks the best one",
+         cxxopts::value<int>()->default_value("-1")) //
+        ("list-devices", "Print the capabilities of the devices and exit") //
+        ("backend",
+         "Where to sort: vulkan, cpu, or auto for a device if there is "
+         "a usable one",
+         cxxopts::value<std::string>()->default_value("auto")) //
+        ("threads", "Threads of the CPU backend, 0 uses every core",
+         cxxopts::value<uint32_t>()->default_value("0")) //
+        ("schedule",
+         "How the CPU threads wait for each other: barriers after every "
+         "layer or dataflow between tiles",
+         cxxopts::value<std::string>()->default_value("dataflow")) //
+        ("scaling",
+         "Time both CPU schedules on 1, 2, 4 and so on up to --threads "
+         "threads and exit") //
+        ("pipeline-cache", "Directory to keep the compiled pipelines in",
+         cxxopts::value<std::string>()->default_value("")) //
+        ("pipeline-times",
+         "Report pipeline creation times without and with the cache") //
+        ("d,debug", "Print initial and sorted array")        //
         ("h,help", "Print usage");
     options.parse_positional("n");
     auto result = options.parse(argc, argv);
@@ -17,9 +96,34 @@ Options Options::parse(int argc, char** argv) {
         std::cout << options.help() << std::endl;
         exit(0);
     }
+    // Listing the devices doesn't need an array
+    bool list_devices = result["list-devices"].as<bool>();
+    if (!list_devices && !result.count("n")) {
+        std::cerr << options.help() << std::endl;
+        exit(1);
+    }
     return {
-        .n = result["n"].as<uint32_t>(),
+        .n = list_devices ? 0 : result["n"].as<uint64_t>(),
         .seed = result["seed"].as<uint32_t>(),
+        .register_run = result["register-run"].as<uint32_t>(),
+        .tile_size = result["workgroup-size"].as<uint32_t>(),
+        .key_type = parse_key_type(result["type"].as<std::string>()),
+        .value_type = parse_value_type(result["values"].as<uint32_t>()),
+        .padded = result["padded"].as<bool>(),
+        .segments = result["segments"].as<uint32_t>(),
+        .chunk_size = result["chunk-size"].as<uint32_t>(),
+        .staging = result["staging"].as<bool>(),
+        .multi = result["multi"].as<bool>(),
+        .hybrid = result["hybrid"].as<bool>(),
+        .split_cache_dir = result["split-cache"].as<std::string>(),
+        .device = result["device"].as<int>(),
+        .list_devices = list_devices,
+        .backend = parse_backend(result["backend"].as<std::string>()),
+        .threads = result["threads"].as<uint32_t>(),
+        .schedule = parse_schedule(result["schedule"].as<std::string>()),
+        .scaling = result["scaling"].as<bool>(),
+        .pipeline_cache_dir = result["pipeline-cache"].as<std::string>(),
+        .pipeline_times = result["pipeline-times"].as<bool>(),
         .debug = result["debug"].as<bool>(),
     };
 };
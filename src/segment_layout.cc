@@ -0,0 +1,51 @@
+#include "segment_layout.h"
+#include <algorithm>
+#include <bit>
+#include <stdexcept>
+
+// The segments are padded to powers of 2 with the maximal keys and laid
+// out by decreasing padded lengths, so every segment starts at a multiple
+// of its padded length and the ones of at least a given size form
+// a prefix
+Layout lay_out_segments(std::span<const uint32_t> offsets, size_t n,
+                        size_t max_size, std::vector<Segment>& segments) {
+    segments.clear();
+    for (size_t k = 0; k + 1 < offsets.size(); k++) {
+        if (offsets[k] > offsets[k + 1] || offsets[k + 1] > n) {
+            throw std::runtime_error("segment offsets must be increasing "
+                                     "and within the array");
+        }
+        uint32_t length = offsets[k + 1] - offsets[k];
+        if (length >= 2) {
+            segments.push_back({offsets[k], 0, length, std::bit_ceil(length)});
+        }
+    }
+    if (segments.empty()) {
+        return {0, {}};
+    }
+    std::stable_sort(segments.begin(), segments.end(),
+                     [](const Segment& a, const Segment& b) {
+                         return a.padded_length > b.padded_length;
+                     });
+    uint64_t total = 0;
+    for (Segment& segment : segments) {
+        segment.padded_offset = total;
+        total += segment.padded_length;
+        if (total > max_size) {
+            throw std::runtime_error("batch is too long for the device");
+        }
+    }
+
+    Layout layout{uint32_t(total), {}};
+    uint32_t max_length = segments.front().padded_length;
+    layout.bounds.resize(std::countr_zero(max_length));
+    uint32_t bound = 0;
+    size_t k = 0;
+    for (uint32_t m = max_length; m >= 2; m >>= 1) {
+        for (; k < segments.size() && segments[k].padded_length >= m; k++) {
+            bound += segments[k].padded_length;
+        }
+        layout.bounds[std::countr_zero(m) - 1] = bound;
+    }
+    return layout;
+}
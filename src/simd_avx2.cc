@@ -0,0 +1,108 @@
+// Built with -mavx2, the kernels are only called on CPUs supporting it
+#include "simd_network.h"
+#include "simd_sort.h"
+#include <cstdint>
+#include <immintrin.h>
+#include <type_traits>
+
+namespace {
+
+// Keys in a 256-bit register. Lanes are permuted by 32-bit words,
+// a 64-bit lane is a pair of them
+template <typename Key> struct Avx2Isa {
+    using T = Key;
+    using V = __m256i;
+    static constexpr size_t WIDTH = 32 / sizeof(T);
+
+    struct Words {
+        alignas(32) int32_t words[8];
+    };
+
+    static constexpr Words index(const int* lanes) {
+        Words index = {};
+        for (size_t w = 0; w < 8; w++) {
+            index.words[w] =
+                sizeof(T) == 4 ? lanes[w] : 2 * lanes[w / 2] + w % 2;
+        }
+        return index;
+    }
+
+    static constexpr Words mask(const bool* lanes) {
+        Words mask = {};
+        for (size_t w = 0; w < 8; w++) {
+            mask.words[w] = lanes[sizeof(T) == 4 ? w : w / 2] ? -1 : 0;
+        }
+        return mask;
+    }
+
+    static V load(const T* p) {
+        return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    }
+    static void store(T* p, V v) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), v);
+    }
+    static V permute(V v, const Words& index) {
+        return _mm256_permutevar8x32_epi32(
+            v, _mm256_load_si256(reinterpret_cast<const __m256i*>(&index)));
+    }
+    static V blend(V a, V b, const Words& mask) {
+        return _mm256_blendv_epi8(
+            a, b, _mm256_load_si256(reinterpret_cast<const __m256i*>(&mask)));
+    }
+
+    // There are no 64-bit integer min and max, the lanes are picked
+    // by a signed comparison. Unsigned keys get their sign bits flipped
+    static V greater(V a, V b) {
+        if constexpr (std::is_unsigned_v<T>) {
+            V sign = _mm256_set1_epi64x(INT64_MIN);
+            a = _mm256_xor_si256(a, sign);
+            b = _mm256_xor_si256(b, sign);
+        }
+        return _mm256_cmpgt_epi64(a, b);
+    }
+
+    static V min(V a, V b) {
+        if constexpr (std::is_same_v<T, float>) {
+            return _mm256_castps_si256(
+                _mm256_min_ps(_mm256_castsi256_ps(a), _mm256_castsi256_ps(b)));
+        } else if constexpr (std::is_same_v<T, double>) {
+            return _mm256_castpd_si256(
+                _mm256_min_pd(_mm256_castsi256_pd(a), _mm256_castsi256_pd(b)));
+        } else if constexpr (std::is_same_v<T, uint32_t>) {
+            return _mm256_min_epu32(a, b);
+        } else if constexpr (std::is_same_v<T, int32_t>) {
+            return _mm256_min_epi32(a, b);
+        } else {
+            return _mm256_blendv_epi8(a, b, greater(a, b));
+        }
+    }
+
+    static V max(V a, V b) {
+        if constexpr (std::is_same_v<T, float>) {
+            return _mm256_castps_si256(
+                _mm256_max_ps(_mm256_castsi256_ps(a), _mm256_castsi256_ps(b)));
+        } else if constexpr (std::is_same_v<T, double>) {
+            return _mm256_castpd_si256(
+                _mm256_max_pd(_mm256_castsi256_pd(a), _mm256_castsi256_pd(b)));
+        } else if constexpr (std::is_same_v<T, uint32_t>) {
+            return _mm256_max_epu32(a, b);
+        } else if constexpr (std::is_same_v<T, int32_t>) {
+            return _mm256_max_epi32(a, b);
+        } else {
+            return _mm256_blendv_epi8(b, a, greater(a, b));
+        }
+    }
+};
+
+} // namespace
+
+template <typename T> SimdKernels<T> avx2_kernels() {
+    return make_kernels<Avx2Isa<T>>();
+}
+
+template SimdKernels<uint32_t> avx2_kernels();
+template SimdKernels<int32_t> avx2_kernels();
+template SimdKernels<uint64_t> avx2_kernels();
+template SimdKernels<int64_t> avx2_kernels();
+template SimdKernels<float> avx2_kernels();
+template SimdKernels<double> avx2_kernels();
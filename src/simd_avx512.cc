@@ -0,0 +1,106 @@
+// Built with -mavx512f, the kernels are only called on CPUs supporting it
+#include "simd_network.h"
+#include "simd_sort.h"
+#include <cstdint>
+#include <type_traits>
+
+// GCC 12 reports the undefined passthrough registers of the intrinsics
+// as uninitialized
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#pragma GCC diagnostic pop
+
+namespace {
+
+// Keys in a 512-bit register. Lanes are permuted by 32-bit words,
+// a 64-bit lane is a pair of them, and blended by mask registers
+template <typename Key> struct Avx512Isa {
+    using T = Key;
+    using V = __m512i;
+    static constexpr size_t WIDTH = 64 / sizeof(T);
+
+    struct Words {
+        alignas(64) int32_t words[16];
+    };
+
+    static constexpr Words index(const int* lanes) {
+        Words index = {};
+        for (size_t w = 0; w < 16; w++) {
+            index.words[w] =
+                sizeof(T) == 4 ? lanes[w] : 2 * lanes[w / 2] + w % 2;
+        }
+        return index;
+    }
+
+    static constexpr uint32_t mask(const bool* lanes) {
+        uint32_t mask = 0;
+        for (size_t l = 0; l < WIDTH; l++) {
+            mask |= uint32_t(lanes[l]) << l;
+        }
+        return mask;
+    }
+
+    static V load(const T* p) { return _mm512_loadu_si512(p); }
+    static void store(T* p, V v) { _mm512_storeu_si512(p, v); }
+    static V permute(V v, const Words& index) {
+        return _mm512_permutexvar_epi32(_mm512_load_si512(&index), v);
+    }
+    static V blend(V a, V b, uint32_t mask) {
+        if constexpr (sizeof(T) == 4) {
+            return _mm512_mask_blend_epi32(__mmask16(mask), a, b);
+        } else {
+            return _mm512_mask_blend_epi64(__mmask8(mask), a, b);
+        }
+    }
+
+    static V min(V a, V b) {
+        if constexpr (std::is_same_v<T, float>) {
+            return _mm512_castps_si512(
+                _mm512_min_ps(_mm512_castsi512_ps(a), _mm512_castsi512_ps(b)));
+        } else if constexpr (std::is_same_v<T, double>) {
+            return _mm512_castpd_si512(
+                _mm512_min_pd(_mm512_castsi512_pd(a), _mm512_castsi512_pd(b)));
+        } else if constexpr (std::is_same_v<T, uint32_t>) {
+            return _mm512_min_epu32(a, b);
+        } else if constexpr (std::is_same_v<T, int32_t>) {
+            return _mm512_min_epi32(a, b);
+        } else if constexpr (std::is_same_v<T, uint64_t>) {
+            return _mm512_min_epu64(a, b);
+        } else {
+            return _mm512_min_epi64(a, b);
+        }
+    }
+
+    static V max(V a, V b) {
+        if constexpr (std::is_same_v<T, float>) {
+            return _mm512_castps_si512(
+                _mm512_max_ps(_mm512_castsi512_ps(a), _mm512_castsi512_ps(b)));
+        } else if constexpr (std::is_same_v<T, double>) {
+            return _mm512_castpd_si512(
+                _mm512_max_pd(_mm512_castsi512_pd(a), _mm512_castsi512_pd(b)));
+        } else if constexpr (std::is_same_v<T, uint32_t>) {
+            return _mm512_max_epu32(a, b);
+        } else if constexpr (std::is_same_v<T, int32_t>) {
+            return _mm512_max_epi32(a, b);
+        } else if constexpr (std::is_same_v<T, uint64_t>) {
+            return _mm512_max_epu64(a, b);
+        } else {
+            return _mm512_max_epi64(a, b);
+        }
+    }
+};
+
+} // namespace
+
+template <typename T> SimdKernels<T> avx512_kernels() {
+    return make_kernels<Avx512Isa<T>>();
+}
+
+template SimdKernels<uint32_t> avx512_kernels();
+template SimdKernels<int32_t> avx512_kernels();
+template SimdKernels<uint64_t> avx512_kernels();
+template SimdKernels<int64_t> avx512_kernels();
+template SimdKernels<float> avx512_kernels();
+template SimdKernels<double> avx512_kernels();
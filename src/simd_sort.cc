@@ -0,0 +1,64 @@
+#include "simd_sort.h"
+#include "simd_network.h"
+#include <cstdint>
+
+namespace {
+
+// A key per register, the network compiles to branchless min and max
+template <typename Key> struct ScalarIsa {
+    using T = Key;
+    using V = Key;
+    static constexpr size_t WIDTH = 1;
+
+    static V load(const T* p) { return *p; }
+    static void store(T* p, V v) { *p = v; }
+    static V min(V a, V b) { return b < a ? b : a; }
+    static V max(V a, V b) { return a < b ? b : a; }
+};
+
+} // namespace
+
+template <typename T> SimdKernels<T> scalar_kernels() {
+    return make_kernels<ScalarIsa<T>>();
+}
+
+// CPUID through the compiler, which also checks that the OS saves
+// the wider registers
+SimdLevel simd_level() {
+#ifdef HAVE_X86_SIMD
+    if (__builtin_cpu_supports("avx512f")) {
+        return Avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return Avx2;
+    }
+#endif
+    return Scalar;
+}
+
+template <typename T> const SimdKernels<T>& simd_kernels() {
+    static const SimdKernels<T> kernels = [] {
+        switch (simd_level()) {
+#ifdef HAVE_X86_SIMD
+        case Avx512:
+            return avx512_kernels<T>();
+        case Avx2:
+            return avx2_kernels<T>();
+#endif
+        default:
+            return scalar_kernels<T>();
+        }
+    }();
+    return kernels;
+}
+
+#define INSTANTIATE(T)                                                         \
+    template SimdKernels<T> scalar_kernels();                                  \
+    template const SimdKernels<T>& simd_kernels()
+INSTANTIATE(uint32_t);
+INSTANTIATE(int32_t);
+INSTANTIATE(uint64_t);
+INSTANTIATE(int64_t);
+INSTANTIATE(float);
+INSTANTIATE(double);
+#undef INSTANTIATE
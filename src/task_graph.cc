@@ -0,0 +1,165 @@
+#include "task_graph.h"
+#include <atomic>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <thread>
+
+namespace {
+
+// Slots of a deque, a full ring is replaced by one twice as large
+struct Ring {
+    explicit Ring(size_t capacity) : mask(capacity - 1), slots(capacity) {}
+
+    uint32_t get(int64_t i) const {
+        return slots[i & mask].load(std::memory_order_relaxed);
+    }
+    void put(int64_t i, uint32_t task) {
+        slots[i & mask].store(task, std::memory_order_relaxed);
+    }
+
+    size_t mask;
+    std::vector<std::atomic<uint32_t>> slots;
+};
+
+// Lock-free deque of Chase and Lev, in the formulation for the C11 memory
+// model by Lê et al. The owner pushes and pops at the bottom, the other
+// threads steal from the top
+class TaskDeque {
+  public:
+    TaskDeque() { ring = rings.emplace_back(new Ring(256)).get(); }
+
+    void push(uint32_t task) {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        Ring* r = ring.load(std::memory_order_relaxed);
+        if (b - t > int64_t(r->mask)) {
+            r = grow(r, t, b);
+        }
+        r->put(b, task);
+        bottom.store(b + 1, std::memory_order_release);
+    }
+
+    bool pop(uint32_t& task) {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        Ring* r = ring.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+        if (t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+        task = r->get(b);
+        if (t < b) {
+            return true;
+        }
+        // The last task, a thief may be taking it at the same time
+        bool won = top.compare_exchange_strong(t, t + 1,
+                                               std::memory_order_seq_cst,
+                                               std::memory_order_relaxed);
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return won;
+    }
+
+    // Fails when the deque is empty or another thread took the task first
+    bool steal(uint32_t& task) {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b) {
+            return false;
+        }
+        task = ring.load(std::memory_order_acquire)->get(t);
+        return top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                           std::memory_order_relaxed);
+    }
+
+  private:
+    // Thieves may still read the old ring, it's kept until the deque goes
+    Ring* grow(Ring* old, int64_t t, int64_t b) {
+        Ring* r = rings.emplace_back(new Ring(2 * (old->mask + 1))).get();
+        for (int64_t i = t; i < b; i++) {
+            r->put(i, old->get(i));
+        }
+        ring.store(r, std::memory_order_release);
+        return r;
+    }
+
+    alignas(64) std::atomic<int64_t> top{0};
+    alignas(64) std::atomic<int64_t> bottom{0};
+    std::atomic<Ring*> ring;
+    std::vector<std::unique_ptr<Ring>> rings;
+};
+
+} // namespace
+
+uint32_t TaskGraph::add(std::span<const uint32_t> deps) {
+    uint32_t task = dep_counts.size();
+    dep_counts.push_back(deps.size());
+    for (uint32_t dep : deps) {
+        edges.emplace_back(dep, task);
+    }
+    return task;
+}
+
+void TaskGraph::run(ThreadPool& pool,
+                    const std::function<void(uint32_t)>& task) const {
+    // Tasks waiting for each task, grouped by the one they wait for
+    std::vector<uint32_t> offsets(size() + 1);
+    for (auto [dep, waiting] : edges) {
+        offsets[dep + 1]++;
+    }
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+    std::vector<uint32_t> successors(edges.size());
+    std::vector<uint32_t> filled(offsets.begin(), offsets.end() - 1);
+    for (auto [dep, waiting] : edges) {
+        successors[filled[dep]++] = waiting;
+    }
+
+    std::vector<std::atomic<uint32_t>> pending(size());
+    std::vector<uint32_t> roots;
+    for (uint32_t t = 0; t < size(); t++) {
+        pending[t].store(dep_counts[t], std::memory_order_relaxed);
+        if (dep_counts[t] == 0) {
+            roots.push_back(t);
+        }
+    }
+    std::atomic<uint32_t> remaining{size()};
+    uint32_t threads = pool.size();
+    std::unique_ptr<TaskDeque[]> deques{new TaskDeque[threads]};
+
+    pool.run([&](uint32_t thread) {
+        TaskDeque& own = deques[thread];
+        // The tasks without dependencies are dealt out in turns, pushed
+        // backwards for the earlier ones to be popped first
+        for (size_t r = roots.size(); r-- > 0;) {
+            if (r % threads == thread) {
+                own.push(roots[r]);
+            }
+        }
+        std::minstd_rand random{thread + 1};
+        while (remaining.load(std::memory_order_acquire) > 0) {
+            uint32_t t;
+            bool found = own.pop(t);
+            // Every other thread is tried once, from a random one
+            uint32_t first = random() % threads;
+            for (uint32_t k = 0; !found && k < threads; k++) {
+                uint32_t victim = (first + k) % threads;
+                found = victim != thread && deques[victim].steal(t);
+            }
+            if (!found) {
+                std::this_thread::yield();
+                continue;
+            }
+            task(t);
+            for (uint32_t s = offsets[t]; s < offsets[t + 1]; s++) {
+                if (pending[successors[s]].fetch_sub(
+                        1, std::memory_order_acq_rel) == 1) {
+                    own.push(successors[s]);
+                }
+            }
+            remaining.fetch_sub(1, std::memory_order_release);
+        }
+    });
+}
@@ -0,0 +1,55 @@
+#include "thread_pool.h"
+#include <algorithm>
+
+ThreadPool::ThreadPool(uint32_t threads) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (uint32_t index = 1; index < threads; index++) {
+        workers.emplace_back([this, index] { work(index); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock{mutex};
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::run(const std::function<void(uint32_t)>& job) {
+    {
+        std::lock_guard lock{mutex};
+        this->job = &job;
+        running = workers.size();
+        jobs++;
+    }
+    wake.notify_all();
+    job(0);
+    std::unique_lock lock{mutex};
+    done.wait(lock, [this] { return running == 0; });
+    this->job = nullptr;
+}
+
+void ThreadPool::work(uint32_t index) {
+    uint64_t seen = 0;
+    while (true) {
+        std::unique_lock lock{mutex};
+        wake.wait(lock, [&] { return stopping || jobs != seen; });
+        if (stopping) {
+            return;
+        }
+        seen = jobs;
+        const std::function<void(uint32_t)>& current = *job;
+        lock.unlock();
+        current(index);
+        lock.lock();
+        if (--running == 0) {
+            done.notify_one();
+        }
+    }
+}
@@ -14,6 +14,6 @@ void Timer::run(std::function<void()> f) {
     auto begin = std::chrono::steady_clock::now();
     f();
     auto end = std::chrono::steady_clock::now();
-    out_ << prefix_ << " " << std::fixed << std::setprecision(2)
+    out_ << prefix_ << " " << std::fixed << std::setprecision(4)
          << std::chrono::duration_cast<fsecs>(end - begin).count() << std::endl;
 }
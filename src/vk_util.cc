@@ -1,9 +1,18 @@
 #include "vk_util.h"
 #include "defs.h"
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
 #include <cstring>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <optional>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <vector>
 #include <vulkan/vulkan.h>
 
@@ -70,6 +79,8 @@ void set_instance(VkInfo* vk_info) {
     VkApplicationInfo app_info{};
     app_info.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
     app_info.pApplicationName = "EntryTask";
+    // Needed for subgroup operations
+    app_info.apiVersion = VK_API_VERSION_1_1;
 
     VkInstanceCreateInfo create_info = {
         .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
@@ -98,74 +109,489 @@ void set_instance(VkInfo* vk_info) {
     create_info.pNext = (VkDebugUtilsMessengerCreateInfoEXT*)&debug_create_info;
 #endif
 
-    VK_CHECK_RESULT(vkCreateInstance(&create_info, NULL, &vk_info->instance));
+    // Fails on the machines without a Vulkan driver
+    VkResult res = vkCreateInstance(&create_info, NULL, &vk_info->instance);
+    if (res != VK_SUCCESS) {
+        throw std::runtime_error("failed to create Vulkan instance: " +
+                                 err_string(res));
+    }
 }
 
-void set_physical_device(VkInfo* vk_info) {
+static std::vector<VkPhysicalDevice> get_physical_devices(VkInfo* vk_info) {
     uint32_t gpu_count;
     VK_CHECK_RESULT(
         vkEnumeratePhysicalDevices(vk_info->instance, &gpu_count, NULL));
-    assert(gpu_count >= 1);
     std::vector<VkPhysicalDevice> devices(gpu_count);
     VK_CHECK_RESULT(vkEnumeratePhysicalDevices(vk_info->instance, &gpu_count,
                                                devices.data()));
-    vk_info->physical_device = devices[0];
+    return devices;
+}
+
+uint32_t count_physical_devices(VkInfo* vk_info) {
+    return get_physical_devices(vk_info).size();
+}
+
+static std::vector<VkQueueFamilyProperties>
+get_queue_families(VkPhysicalDevice device) {
+    uint32_t queue_family_count;
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &queue_family_count, NULL);
+    std::vector<VkQueueFamilyProperties> queue_props(queue_family_count);
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &queue_family_count,
+                                             queue_props.data());
+    return queue_props;
+}
+
+// Dispatches go to a compute family without graphics if there is one,
+// such families are served by asynchronous compute engines. Compute
+// families support copies as well. Returns -1 if there is none
+static int find_compute_family(
+    const std::vector<VkQueueFamilyProperties>& queue_props) {
+    int family = -1;
+    for (size_t i = 0; i < queue_props.size(); i++) {
+        VkQueueFlags flags = queue_props[i].queueFlags;
+        if (!(flags & VK_QUEUE_COMPUTE_BIT)) {
+            continue;
+        }
+        if (!(flags & VK_QUEUE_GRAPHICS_BIT)) {
+            return i;
+        }
+        if (family < 0) {
+            family = i;
+        }
+    }
+    return family;
+}
+
+// Copies go to a family with transfers only if there is one, such
+// families are usually served by dedicated copy engines. Returns -1
+// if there is none
+static int find_transfer_family(
+    const std::vector<VkQueueFamilyProperties>& queue_props) {
+    for (size_t i = 0; i < queue_props.size(); i++) {
+        VkQueueFlags flags = queue_props[i].queueFlags;
+        if ((flags & VK_QUEUE_TRANSFER_BIT) &&
+            !(flags & (VK_QUEUE_COMPUTE_BIT | VK_QUEUE_GRAPHICS_BIT))) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Whether the device has a queue family for dispatches and Vulkan 1.1
+// for the dispatches with a base
+bool is_suitable_device(uint32_t device_index, VkInfo* vk_info) {
+    VkPhysicalDevice device = get_physical_devices(vk_info).at(device_index);
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(device, &properties);
+    return properties.apiVersion >= VK_API_VERSION_1_1 &&
+           find_compute_family(get_queue_families(device)) >= 0;
+}
+
+// What devices are ranked by
+struct DeviceCapabilities {
+    VkPhysicalDeviceProperties properties;
+    VkDeviceSize device_local_size;
+    uint32_t subgroup_size;
+    bool timestamps;
+};
+
+static DeviceCapabilities get_capabilities(VkPhysicalDevice device) {
+    DeviceCapabilities caps = {};
+    vkGetPhysicalDeviceProperties(device, &caps.properties);
+    VkPhysicalDeviceMemoryProperties memory_properties;
+    vkGetPhysicalDeviceMemoryProperties(device, &memory_properties);
+    for (uint32_t i = 0; i < memory_properties.memoryHeapCount; i++) {
+        if (memory_properties.memoryHeaps[i].flags &
+            VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) {
+            caps.device_local_size += memory_properties.memoryHeaps[i].size;
+        }
+    }
+    VkPhysicalDeviceSubgroupProperties subgroup_properties = {};
+    subgroup_properties.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES;
+    subgroup_properties.subgroupSize = 1;
+    if (caps.properties.apiVersion >= VK_API_VERSION_1_1) {
+        VkPhysicalDeviceProperties2 properties2 = {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+            .pNext = &subgroup_properties,
+            .properties = {},
+        };
+        vkGetPhysicalDeviceProperties2(device, &properties2);
+    }
+    caps.subgroup_size = subgroup_properties.subgroupSize;
+    caps.timestamps = caps.properties.limits.timestampComputeAndGraphics;
+    return caps;
+}
+
+// Devices are ranked by their type first: discrete GPUs, integrated
+// ones, virtual ones and CPU implementations. Ties are broken by
+// the device-local memory, the subgroup size and timestamp support
+static std::tuple<int, VkDeviceSize, uint32_t, bool>
+device_score(const DeviceCapabilities& caps) {
+    int type_rank = 0;
+    switch (caps.properties.deviceType) {
+    case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:
+        type_rank = 4;
+        break;
+    case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:
+        type_rank = 3;
+        break;
+    case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:
+        type_rank = 2;
+        break;
+    case VK_PHYSICAL_DEVICE_TYPE_CPU:
+        type_rank = 1;
+        break;
+    default:
+        break;
+    }
+    return {type_rank, caps.device_local_size, caps.subgroup_size,
+            caps.timestamps};
+}
+
+// Index of the best suitable device
+uint32_t select_device(VkInfo* vk_info) {
+    std::vector<VkPhysicalDevice> devices = get_physical_devices(vk_info);
+    int best = -1;
+    std::tuple<int, VkDeviceSize, uint32_t, bool> best_score;
+    for (uint32_t i = 0; i < devices.size(); i++) {
+        if (!is_suitable_device(i, vk_info)) {
+            continue;
+        }
+        auto score = device_score(get_capabilities(devices[i]));
+        if (best < 0 || score > best_score) {
+            best = i;
+            best_score = score;
+        }
+    }
+    if (best < 0) {
+        throw std::runtime_error("no device supports Vulkan 1.1 compute");
+    }
+    return best;
+}
+
+static const char* device_type_name(VkPhysicalDeviceType type) {
+    switch (type) {
+    case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:
+        return "discrete GPU";
+    case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:
+        return "integrated GPU";
+    case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:
+        return "virtual GPU";
+    case VK_PHYSICAL_DEVICE_TYPE_CPU:
+        return "CPU";
+    default:
+        return "other";
+    }
+}
+
+// Print the capabilities the devices are selected by and their queue
+// families, marking the device and the families that would be used
+void list_devices(std::ostream& out) {
+    VkInfo vk_info;
+    set_instance(&vk_info);
+    std::vector<VkPhysicalDevice> devices = get_physical_devices(&vk_info);
+    int selected = -1;
+    try {
+        selected = select_device(&vk_info);
+    } catch (const std::runtime_error&) {
+    }
+    for (uint32_t i = 0; i < devices.size(); i++) {
+        DeviceCapabilities caps = get_capabilities(devices[i]);
+        auto queue_props = get_queue_families(devices[i]);
+        int compute_family = find_compute_family(queue_props);
+        int transfer_family = find_transfer_family(queue_props);
+        out << (int(i) == selected ? "* " : "  ") << i << ": "
+            << caps.properties.deviceName << " ("
+            << device_type_name(caps.properties.deviceType) << ")\n"
+            << "    device-local memory: " << (caps.device_local_size >> 20)
+            << " MiB, subgroup size: " << caps.subgroup_size
+            << ", timestamps: " << (caps.timestamps ? "yes" : "no")
+            << ", max workgroup size: "
+            << caps.properties.limits.maxComputeWorkGroupInvocations
+            << ", shared memory: "
+            << caps.properties.limits.maxComputeSharedMemorySize << " B\n";
+        for (size_t f = 0; f < queue_props.size(); f++) {
+            VkQueueFlags flags = queue_props[f].queueFlags;
+            out << "    family " << f << ": " << queue_props[f].queueCount
+                << " queues,"
+                << (flags & VK_QUEUE_GRAPHICS_BIT ? " graphics" : "")
+                << (flags & VK_QUEUE_COMPUTE_BIT ? " compute" : "")
+                << (flags & VK_QUEUE_TRANSFER_BIT ? " transfer" : "")
+                << (int(f) == compute_family ? " [dispatches]" : "")
+                << (int(f) == transfer_family ? " [copies]" : "") << "\n";
+        }
+    }
+    vkDestroyInstance(vk_info.instance, NULL);
+}
+
+void set_physical_device(VkInfo* vk_info, uint32_t device_index) {
+    std::vector<VkPhysicalDevice> devices = get_physical_devices(vk_info);
+    assert(device_index < devices.size());
+    vk_info->physical_device = devices[device_index];
 
     vkGetPhysicalDeviceMemoryProperties(vk_info->physical_device,
                                         &vk_info->memory_properties);
+    vkGetPhysicalDeviceProperties(vk_info->physical_device,
+                                  &vk_info->properties);
+
+    // Integrated GPUs and CPU implementations share the memory with
+    // the host, so copying through staging buffers is pure overhead.
+    // Discrete GPUs can expose host-visible device memory as well,
+    // but the kernels would read it across the bus
+    VkMemoryPropertyFlags unified_flags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+                                          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    VkPhysicalDeviceType device_type = vk_info->properties.deviceType;
+    vk_info->unified_memory = false;
+    if (device_type == VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU ||
+        device_type == VK_PHYSICAL_DEVICE_TYPE_CPU) {
+        const auto& memory_properties = vk_info->memory_properties;
+        for (uint32_t i = 0; i < memory_properties.memoryTypeCount; i++) {
+            if ((memory_properties.memoryTypes[i].propertyFlags &
+                 unified_flags) == unified_flags) {
+                vk_info->unified_memory = true;
+            }
+        }
+    }
+
+    vk_info->subgroup_properties = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES,
+        .pNext = NULL,
+        .subgroupSize = 1,
+        .supportedStages = 0,
+        .supportedOperations = 0,
+        .quadOperationsInAllStages = VK_FALSE,
+    };
+    if (vk_info->properties.apiVersion >= VK_API_VERSION_1_1) {
+        VkPhysicalDeviceProperties2 properties2 = {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+            .pNext = &vk_info->subgroup_properties,
+            .properties = {},
+        };
+        vkGetPhysicalDeviceProperties2(vk_info->physical_device,
+                                       &properties2);
+    }
+
+    std::vector<VkQueueFamilyProperties> queue_props =
+        get_queue_families(vk_info->physical_device);
+    int compute_family = find_compute_family(queue_props);
+    assert(compute_family >= 0);
+    vk_info->queue_family_index = compute_family;
 
-    float queue_priority = 1.0f;
     VkDeviceQueueCreateInfo queue_info = {
         .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
         .pNext = NULL,
         .flags = 0,
-        .queueFamilyIndex = 0, // TO BE CHANGED
-        .queueCount = 16,
-        .pQueuePriorities = &queue_priority,
+        .queueFamilyIndex = vk_info->queue_family_index,
+        .queueCount = 1,
+        .pQueuePriorities = NULL,
     };
 
-    uint32_t queue_family_count;
-    vkGetPhysicalDeviceQueueFamilyProperties(vk_info->physical_device,
-                                             &queue_family_count, NULL);
-    assert(queue_family_count >= 1);
-
-    std::vector<VkQueueFamilyProperties> queue_props(queue_family_count);
-    vkGetPhysicalDeviceQueueFamilyProperties(
-        vk_info->physical_device, &queue_family_count, queue_props.data());
-    assert(queue_family_count >= 1);
-
-    bool found = false;
-    for (unsigned int i = 0; i < queue_family_count; i++) {
-        if ((queue_props[i].queueFlags &
-             (VK_QUEUE_COMPUTE_BIT | VK_QUEUE_TRANSFER_BIT)) ==
-            (VK_QUEUE_COMPUTE_BIT | VK_QUEUE_TRANSFER_BIT)) {
-            queue_info.queueFamilyIndex = i;
-            found = true;
-        }
+    // Every queue of the family is opened, sorters can be spread over them
+    queue_info.queueCount =
+        std::min(queue_props[queue_info.queueFamilyIndex].queueCount,
+                 MAX_COMPUTE_QUEUES);
+    std::vector<float> queue_priorities(queue_info.queueCount, 1.0f);
+    queue_info.pQueuePriorities = queue_priorities.data();
+
+    // Copy engines run alongside the compute queue
+    VkDeviceQueueCreateInfo queue_infos[2] = {queue_info, queue_info};
+    uint32_t queue_info_count = 1;
+    vk_info->transfer_queue_family_index = vk_info->queue_family_index;
+    int transfer_family = find_transfer_family(queue_props);
+    if (transfer_family >= 0) {
+        vk_info->transfer_queue_family_index = transfer_family;
+        queue_infos[1].queueFamilyIndex = transfer_family;
+        queue_infos[1].queueCount = 1;
+        queue_infos[1].pQueuePriorities = queue_priorities.data();
+        queue_info_count = 2;
     }
-    assert(found);
-    assert(queue_family_count >= 1);
-    vk_info->queue_family_index = queue_info.queueFamilyIndex;
+
+    // 64-bit keys need the corresponding shader features,
+    // they are enabled whenever the device has them
+    VkPhysicalDeviceFeatures supported_features;
+    vkGetPhysicalDeviceFeatures(vk_info->physical_device, &supported_features);
+    vk_info->enabled_features = {};
+    vk_info->enabled_features.shaderInt64 = supported_features.shaderInt64;
+    vk_info->enabled_features.shaderFloat64 = supported_features.shaderFloat64;
 
     VkDeviceCreateInfo device_info = {
         .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
         .pNext = NULL,
         .flags = 0,
-        .queueCreateInfoCount = 1,
-        .pQueueCreateInfos = &queue_info,
+        .queueCreateInfoCount = queue_info_count,
+        .pQueueCreateInfos = queue_infos,
         .enabledLayerCount = 0,
         .ppEnabledLayerNames = NULL,
         .enabledExtensionCount = 0,
         .ppEnabledExtensionNames = NULL,
-        .pEnabledFeatures = NULL,
+        .pEnabledFeatures = &vk_info->enabled_features,
     };
     VK_CHECK_RESULT(vkCreateDevice(vk_info->physical_device, &device_info, NULL,
                                    &vk_info->device));
-    vkGetDeviceQueue(vk_info->device, vk_info->queue_family_index, 0,
-                     &vk_info->queue);
+    vk_info->queues.resize(queue_info.queueCount);
+    for (uint32_t i = 0; i < queue_info.queueCount; i++) {
+        vkGetDeviceQueue(vk_info->device, vk_info->queue_family_index, i,
+                         &vk_info->queues[i]);
+    }
+    vk_info->queue = vk_info->queues[0];
+    vkGetDeviceQueue(vk_info->device, vk_info->transfer_queue_family_index, 0,
+                     &vk_info->transfer_queue);
+    vk_info->spec_constants.tile_size = default_tile_size(vk_info);
 }
 
-void create_shader_from_file(std::string name, VkInfo* vk_info) {
+// Upper bound of the default tile, larger workgroups stop paying off
+// and the local kernel's block has to fit into the shared memory
+static constexpr uint32_t MAX_DEFAULT_TILE_SIZE = 256;
+
+uint32_t default_tile_size(VkInfo* vk_info) {
+    const auto& limits = vk_info->properties.limits;
+    uint32_t limit = std::min(limits.maxComputeWorkGroupSize[0],
+                              limits.maxComputeWorkGroupInvocations);
+    // A few subgroups per workgroup: enough to hide latency on wide GPUs,
+    // and small workgroups for CPU implementations with narrow subgroups.
+    // Subgroup sizes are powers of 2, so the tile is one as well
+    uint32_t subgroup_size =
+        std::max(vk_info->subgroup_properties.subgroupSize, 1u);
+    uint32_t tile_size = std::min(subgroup_size * 8, MAX_DEFAULT_TILE_SIZE);
+    while (tile_size > limit) {
+        tile_size >>= 1;
+    }
+    return tile_size;
+}
+
+bool supports_subgroup_shuffles(uint32_t tile_size, VkInfo* vk_info) {
+    const auto& props = vk_info->subgroup_properties;
+    VkSubgroupFeatureFlags required_ops =
+        VK_SUBGROUP_FEATURE_BASIC_BIT | VK_SUBGROUP_FEATURE_SHUFFLE_BIT;
+    return (props.supportedStages & VK_SHADER_STAGE_COMPUTE_BIT) &&
+           (props.supportedOperations & required_ops) == required_ops &&
+           props.subgroupSize <= tile_size;
+}
+
+bool supports_key_type(KeyType key_type, VkInfo* vk_info) {
+    switch (key_type) {
+    case U64:
+    case I64:
+        return vk_info->enabled_features.shaderInt64;
+    case F64:
+        return vk_info->enabled_features.shaderFloat64;
+    default:
+        return true;
+    }
+}
+
+// Written in front of the driver's data, so that a cache is only reused
+// with the device and the driver version it was created with
+struct PipelineCacheHeader {
+    uint32_t magic;
+    uint32_t vendor_id;
+    uint32_t device_id;
+    uint32_t driver_version;
+    uint8_t uuid[VK_UUID_SIZE];
+};
+
+static constexpr uint32_t PIPELINE_CACHE_MAGIC = 0x42534f50;
+
+static PipelineCacheHeader pipeline_cache_header(VkInfo* vk_info) {
+    const auto& props = vk_info->properties;
+    PipelineCacheHeader header = {
+        .magic = PIPELINE_CACHE_MAGIC,
+        .vendor_id = props.vendorID,
+        .device_id = props.deviceID,
+        .driver_version = props.driverVersion,
+        .uuid = {},
+    };
+    std::memcpy(header.uuid, props.pipelineCacheUUID, VK_UUID_SIZE);
+    return header;
+}
+
+// Create the pipeline cache of the device, starting from the one saved
+// in dir if it's valid. An empty dir keeps the cache in memory only
+void create_pipeline_cache(const std::string& dir, VkInfo* vk_info) {
+    std::vector<char> data;
+    if (!dir.empty()) {
+        std::ostringstream path;
+        path << dir << "/pipelines-" << std::hex
+             << vk_info->properties.vendorID << "-"
+             << vk_info->properties.deviceID << ".bin";
+        vk_info->pipeline_cache_path = path.str();
+
+        PipelineCacheHeader expected = pipeline_cache_header(vk_info);
+        PipelineCacheHeader header;
+        std::ifstream file(vk_info->pipeline_cache_path, std::ios::binary);
+        if (file.read(reinterpret_cast<char*>(&header), sizeof(header)) &&
+            std::memcmp(&header, &expected, sizeof(header)) == 0) {
+            data.assign(std::istreambuf_iterator<char>(file),
+                        std::istreambuf_iterator<char>());
+        }
+    }
+
+    VkPipelineCacheCreateInfo pipeline_cache_create_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+        .pNext = NULL,
+        .flags = 0,
+        .initialDataSize = data.size(),
+        .pInitialData = data.data(),
+    };
+    VK_CHECK_RESULT(vkCreatePipelineCache(vk_info->device,
+                                          &pipeline_cache_create_info, NULL,
+                                          &vk_info->pipeline_cache));
+}
+
+void save_pipeline_cache(VkInfo* vk_info) {
+    if (vk_info->pipeline_cache == VK_NULL_HANDLE ||
+        vk_info->pipeline_cache_path.empty()) {
+        return;
+    }
+    size_t size;
+    VK_CHECK_RESULT(vkGetPipelineCacheData(
+        vk_info->device, vk_info->pipeline_cache, &size, NULL));
+    PipelineCacheHeader header = pipeline_cache_header(vk_info);
+    std::string data(sizeof(header) + size, '\0');
+    std::memcpy(data.data(), &header, sizeof(header));
+    VK_CHECK_RESULT(vkGetPipelineCacheData(vk_info->device,
+                                           vk_info->pipeline_cache, &size,
+                                           data.data() + sizeof(header)));
+    data.resize(sizeof(header) + size);
+    replace_file(vk_info->pipeline_cache_path, data, "the pipeline cache");
+}
+
+void replace_file(const std::string& path, std::string_view data,
+                  const char* what) {
+    std::error_code ec;
+    std::filesystem::create_directories(
+        std::filesystem::path{path}.parent_path(), ec);
+    std::string tmp_path = path + ".XXXXXX";
+    int fd = mkstemp(tmp_path.data());
+    if (fd < 0) {
+        std::cerr << "failed to save " << what << " to " << path << ": "
+                  << std::strerror(errno) << std::endl;
+        return;
+    }
+    // mkstemp creates the file readable by the owner only
+    bool written = fchmod(fd, 0644) == 0;
+    for (size_t done = 0; written && done < data.size();) {
+        ssize_t count = write(fd, data.data() + done, data.size() - done);
+        written = count > 0;
+        done += written ? count : 0;
+    }
+    if (close(fd) != 0 || !written) {
+        std::cerr << "failed to save " << what << " to " << path << std::endl;
+        std::filesystem::remove(tmp_path, ec);
+        return;
+    }
+    std::filesystem::rename(tmp_path, path, ec);
+    if (ec) {
+        std::cerr << "failed to save " << what << " to " << path << ": "
+                  << ec.message() << std::endl;
+        std::filesystem::remove(tmp_path, ec);
+    }
+}
+
+void create_shader_from_file(std::string name, KernelType kernel,
+                             SortInfo* sort_info) {
     std::ifstream spirvfile(name.c_str(), std::ios::binary | std::ios::ate);
     std::streampos spirvsize = spirvfile.tellg();
     assert(spirvsize > 0);
@@ -173,40 +599,35 @@ void create_shader_from_file(std::string name, VkInfo* vk_info) {
 
     unsigned char* spirv = new unsigned char[spirvsize];
     spirvfile.read(reinterpret_cast<char*>(spirv), spirvsize);
-    create_shader(spirv, spirvsize, vk_info);
+    create_shader(spirv, spirvsize, kernel, sort_info);
 }
 
-void create_shader(const unsigned char* spirv, size_t size, VkInfo* vk_info) {
-    VkShaderModuleCreateInfo shader_module_create_info = {
-        .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
-        .pNext = NULL,
-        .flags = 0,
-        .codeSize = size,
-        .pCode = reinterpret_cast<const uint32_t*>(spirv),
-    };
-
-    VK_CHECK_RESULT(vkCreateShaderModule(vk_info->device,
-                                         &shader_module_create_info, NULL,
-                                         &vk_info->shader_module));
-
-    VkDescriptorSetLayoutBinding layout_binding;
-    layout_binding = {.binding = 0,
-                      .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
-                      .descriptorCount = 1,
-                      .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
-                      .pImmutableSamplers = 0};
+// Keys are bound to 0 and their payloads, if any, to 1. The pool has
+// room for a descriptor set per array the sorter keeps
+void create_descriptor_pool(uint32_t num_bindings, uint32_t max_sets,
+                            SortInfo* sort_info) {
+    VkInfo* vk_info = sort_info->vk_info;
+    VkDescriptorSetLayoutBinding layout_bindings[2];
+    for (uint32_t binding = 0; binding < num_bindings; binding++) {
+        layout_bindings[binding] = {
+            .binding = binding,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+            .pImmutableSamplers = 0};
+    }
 
     VkDescriptorSetLayoutCreateInfo descriptor_set_layout_create_info = {
         .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
         .pNext = NULL,
         .flags = 0,
-        .bindingCount = 1,
-        .pBindings = &layout_binding,
+        .bindingCount = num_bindings,
+        .pBindings = layout_bindings,
     };
 
     VK_CHECK_RESULT(vkCreateDescriptorSetLayout(
         vk_info->device, &descriptor_set_layout_create_info, NULL,
-        &vk_info->descriptor_set_layout));
+        &sort_info->descriptor_set_layout));
 
     VkPushConstantRange ranges[] = {
         {VK_SHADER_STAGE_COMPUTE_BIT, 0, NUM_PUSH_CSTS * sizeof(push_cst_t)},
@@ -217,62 +638,92 @@ void create_shader(const unsigned char* spirv, size_t size, VkInfo* vk_info) {
         .pNext = NULL,
         .flags = 0,
         .setLayoutCount = 1,
-        .pSetLayouts = &vk_info->descriptor_set_layout,
+        .pSetLayouts = &sort_info->descriptor_set_layout,
         .pushConstantRangeCount = 1,
         .pPushConstantRanges = ranges,
     };
 
     VK_CHECK_RESULT(vkCreatePipelineLayout(vk_info->device,
                                            &pipeline_layout_create_info, NULL,
-                                           &vk_info->pipeline_layout));
+                                           &sort_info->pipeline_layout));
 
-    VkDescriptorPoolSize poolSize = {.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
-                                     .descriptorCount = 1};
+    VkDescriptorPoolSize poolSize = {
+        .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = num_bindings * max_sets,
+    };
 
     VkDescriptorPoolCreateInfo descriptor_pool_create_info = {
         .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
         .pNext = NULL,
         .flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT,
-        .maxSets = 1,
+        .maxSets = max_sets,
         .poolSizeCount = 1,
         .pPoolSizes = &poolSize,
     };
 
     VK_CHECK_RESULT(vkCreateDescriptorPool(vk_info->device,
                                            &descriptor_pool_create_info, NULL,
-                                           &vk_info->descriptor_pool));
+                                           &sort_info->descriptor_pool));
+}
 
+void allocate_descriptor_set(SortInfo* sort_info) {
     VkDescriptorSetAllocateInfo set_allocate_info = {
         .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
         .pNext = NULL,
-        .descriptorPool = vk_info->descriptor_pool,
+        .descriptorPool = sort_info->descriptor_pool,
         .descriptorSetCount = 1,
-        .pSetLayouts = &vk_info->descriptor_set_layout,
+        .pSetLayouts = &sort_info->descriptor_set_layout,
     };
 
-    VK_CHECK_RESULT(vkAllocateDescriptorSets(
-        vk_info->device, &set_allocate_info, &vk_info->descriptor_set));
+    VK_CHECK_RESULT(vkAllocateDescriptorSets(sort_info->vk_info->device,
+                                             &set_allocate_info,
+                                             &sort_info->descriptor_set));
+}
+
+void free_descriptor_set(SortInfo* sort_info) {
+    VK_CHECK_RESULT(vkFreeDescriptorSets(sort_info->vk_info->device,
+                                         sort_info->descriptor_pool, 1,
+                                         &sort_info->descriptor_set));
+}
 
-    VkDescriptorBufferInfo arr_info = {
-        .buffer = vk_info->arr.get_device_buffer(),
-        .offset = 0,
-        .range = VK_WHOLE_SIZE,
+// Point the descriptor set to the buffers of the sorter's array,
+// the pipelines don't depend on them
+void write_descriptor_set(SortInfo* sort_info) {
+    uint32_t num_bindings = sort_info->arr.has_values() ? 2 : 1;
+    VkDescriptorBufferInfo buffer_infos[2] = {
+        {
+            .buffer = sort_info->arr.get_device_buffer(),
+            .offset = 0,
+            .range = VK_WHOLE_SIZE,
+        },
+        {
+            .buffer = sort_info->arr.get_values_device_buffer(),
+            .offset = 0,
+            .range = VK_WHOLE_SIZE,
+        },
     };
 
-    VkWriteDescriptorSet write_descriptor_set = {
-        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-        .pNext = 0,
-        .dstSet = vk_info->descriptor_set,
-        .dstBinding = 0,
-        .dstArrayElement = 0,
-        .descriptorCount = 1,
-        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
-        .pImageInfo = 0,
-        .pBufferInfo = &arr_info,
-        .pTexelBufferView = 0};
+    VkWriteDescriptorSet write_descriptor_sets[2];
+    for (uint32_t binding = 0; binding < num_bindings; binding++) {
+        write_descriptor_sets[binding] = {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .pNext = 0,
+            .dstSet = sort_info->descriptor_set,
+            .dstBinding = binding,
+            .dstArrayElement = 0,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .pImageInfo = 0,
+            .pBufferInfo = &buffer_infos[binding],
+            .pTexelBufferView = 0};
+    }
 
-    vkUpdateDescriptorSets(vk_info->device, 1, &write_descriptor_set, 0, 0);
+    vkUpdateDescriptorSets(sort_info->vk_info->device, num_bindings,
+                           write_descriptor_sets, 0, 0);
+}
 
+void create_command_pool(SortInfo* sort_info) {
+    VkInfo* vk_info = sort_info->vk_info;
     VkCommandPoolCreateInfo command_pool_create_info = {
         .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
         .pNext = NULL,
@@ -282,43 +733,107 @@ void create_shader(const unsigned char* spirv, size_t size, VkInfo* vk_info) {
 
     VK_CHECK_RESULT(vkCreateCommandPool(vk_info->device,
                                         &command_pool_create_info, NULL,
-                                        &vk_info->command_pool));
+                                        &sort_info->command_pool));
+    command_pool_create_info.queueFamilyIndex =
+        vk_info->transfer_queue_family_index;
+    VK_CHECK_RESULT(vkCreateCommandPool(vk_info->device,
+                                        &command_pool_create_info, NULL,
+                                        &sort_info->transfer_command_pool));
+}
 
+void allocate_command_buffer(SortInfo* sort_info) {
     VkCommandBufferAllocateInfo command_buffer_allocate_info = {
         .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
         .pNext = NULL,
-        .commandPool = vk_info->command_pool,
+        .commandPool = sort_info->command_pool,
         .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
         .commandBufferCount = 1,
     };
 
-    VK_CHECK_RESULT(vkAllocateCommandBuffers(vk_info->device,
+    VK_CHECK_RESULT(vkAllocateCommandBuffers(sort_info->vk_info->device,
                                              &command_buffer_allocate_info,
-                                             &vk_info->command_buffer));
+                                             &sort_info->command_buffer));
+}
+
+void free_command_buffer(SortInfo* sort_info) {
+    vkFreeCommandBuffers(sort_info->vk_info->device, sort_info->command_pool,
+                         1, &sort_info->command_buffer);
+}
+
+// Command buffers for the transfer queue
+void allocate_transfer_command_buffer(SortInfo* sort_info) {
+    VkCommandBufferAllocateInfo command_buffer_allocate_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .pNext = NULL,
+        .commandPool = sort_info->transfer_command_pool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = 1,
+    };
+
+    VK_CHECK_RESULT(vkAllocateCommandBuffers(sort_info->vk_info->device,
+                                             &command_buffer_allocate_info,
+                                             &sort_info->command_buffer));
+}
+
+void free_transfer_command_buffer(SortInfo* sort_info) {
+    vkFreeCommandBuffers(sort_info->vk_info->device,
+                         sort_info->transfer_command_pool, 1,
+                         &sort_info->command_buffer);
+}
+
+void create_shader(const unsigned char* spirv, size_t size, KernelType kernel,
+                   SortInfo* sort_info) {
+    VkInfo* vk_info = sort_info->vk_info;
+    VkShaderModuleCreateInfo shader_module_create_info = {
+        .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+        .pNext = NULL,
+        .flags = 0,
+        .codeSize = size,
+        .pCode = reinterpret_cast<const uint32_t*>(spirv),
+    };
+
+    VK_CHECK_RESULT(vkCreateShaderModule(vk_info->device,
+                                         &shader_module_create_info, NULL,
+                                         &sort_info->shader_modules[kernel]));
+
+    // Kernels ignore the constants they don't declare
+    VkSpecializationMapEntry spec_map_entries[] = {
+        {REGISTER_RUN_ID, offsetof(SpecConstants, register_run),
+         sizeof(uint32_t)},
+        {TILE_SIZE_ID, offsetof(SpecConstants, tile_size), sizeof(uint32_t)},
+        {PADDED_ID, offsetof(SpecConstants, padded), sizeof(VkBool32)},
+    };
+
+    VkSpecializationInfo spec_info = {
+        .mapEntryCount = sizeof(spec_map_entries) / sizeof(spec_map_entries[0]),
+        .pMapEntries = spec_map_entries,
+        .dataSize = sizeof(SpecConstants),
+        .pData = &sort_info->spec_constants,
+    };
 
     VkPipelineShaderStageCreateInfo shader_create_info = {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
         .pNext = NULL,
         .flags = 0,
         .stage = VK_SHADER_STAGE_COMPUTE_BIT,
-        .module = vk_info->shader_module,
+        .module = sort_info->shader_modules[kernel],
         .pName = "main",
-        .pSpecializationInfo = NULL,
+        .pSpecializationInfo = &spec_info,
     };
 
     VkComputePipelineCreateInfo pipeline_create_info = {
         .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
         .pNext = NULL,
-        .flags = 0,
+        .flags = VK_PIPELINE_CREATE_DISPATCH_BASE_BIT,
         .stage = shader_create_info,
-        .layout = vk_info->pipeline_layout,
+        .layout = sort_info->pipeline_layout,
         .basePipelineHandle = VK_NULL_HANDLE,
         .basePipelineIndex = 0,
     };
 
-    VK_CHECK_RESULT(vkCreateComputePipelines(vk_info->device, VK_NULL_HANDLE, 1,
-                                             &pipeline_create_info, NULL,
-                                             &vk_info->pipeline));
+    VK_CHECK_RESULT(vkCreateComputePipelines(
+        vk_info->device, vk_info->pipeline_cache, 1, &pipeline_create_info,
+        NULL, &sort_info->pipelines[kernel]));
 }
 
 uint32_t find_memory_type(uint32_t typeFilter, VkMemoryPropertyFlags properties,
@@ -338,14 +853,133 @@ uint32_t find_memory_type(uint32_t typeFilter, VkMemoryPropertyFlags properties,
     throw std::runtime_error("failed to find suitable memory type!");
 }
 
-void create_buffer(VkDeviceSize size, VkBufferUsageFlags usage,
-                   VkMemoryPropertyFlags properties, VkBuffer& buffer,
-                   VkDeviceMemory& bufferMemory, VkInfo* vk_info) {
+// Memory of a new block, the blocks of large buffers hold just them
+constexpr VkDeviceSize MEMORY_BLOCK_SIZE = VkDeviceSize(64) << 20;
+
+// Sizes are rounded up to one of 4 classes between consecutive powers
+// of 2, so that at most a fifth of a buffer is wasted
+static VkDeviceSize size_class(VkDeviceSize size) {
+    if (size <= 256) {
+        return 256;
+    }
+    VkDeviceSize step = VkDeviceSize(1) << (61 - __builtin_clzll(size - 1));
+    return (size + step - 1) / step * step;
+}
+
+// Bytes of the buffers kept for reuse at most
+constexpr VkDeviceSize MAX_FREE_BUFFER_BYTES = VkDeviceSize(256) << 20;
+
+// Bind the first free range of a block of the memory type with enough
+// room to the buffer, a new block is allocated only when there is none
+static MemoryPool::Buffer
+bind_buffer_memory(VkBuffer buffer, const VkMemoryRequirements& requirements,
+                   uint32_t memory_type, VkInfo* vk_info) {
+    MemoryPool::Buffer pooled{};
+    pooled.buffer = buffer;
+    pooled.memory_type = memory_type;
+    MemoryPool::Block* found = nullptr;
+    std::optional<FreeRanges::Range> range;
+    for (MemoryPool::Block& block :
+         vk_info->memory_pool.blocks[memory_type]) {
+        range = block.free_ranges.take(requirements.size,
+                                       requirements.alignment);
+        if (range) {
+            found = &block;
+            break;
+        }
+    }
+
+    if (found == nullptr) {
+        VkDeviceSize size = std::max(MEMORY_BLOCK_SIZE, requirements.size);
+        MemoryPool::Block block = {
+            .memory = VK_NULL_HANDLE,
+            .size = size,
+            .mapped = nullptr,
+            .free_ranges = FreeRanges(size),
+            .buffers = 0,
+        };
+        VkMemoryAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        allocInfo.allocationSize = block.size;
+        allocInfo.memoryTypeIndex = memory_type;
+        if (vkAllocateMemory(vk_info->device, &allocInfo, nullptr,
+                             &block.memory) != VK_SUCCESS) {
+            throw std::runtime_error("failed to allocate buffer memory!");
+        }
+        if (vk_info->memory_properties.memoryTypes[memory_type].propertyFlags &
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+            VK_CHECK_RESULT(vkMapMemory(vk_info->device, block.memory, 0,
+                                        block.size, 0, &block.mapped));
+        }
+        range = block.free_ranges.take(requirements.size,
+                                       requirements.alignment);
+        found = &vk_info->memory_pool.blocks[memory_type].emplace_back(
+            std::move(block));
+    }
+
+    vkBindBufferMemory(vk_info->device, buffer, found->memory, range->offset);
+    found->buffers++;
+    pooled.memory = found->memory;
+    pooled.mapped = found->mapped == nullptr
+                        ? nullptr
+                        : static_cast<char*>(found->mapped) + range->offset;
+    pooled.range_offset = range->start;
+    pooled.range_size = range->size;
+    return pooled;
+}
+
+// Destroy the buffer and give its range back to the block, merged with
+// the free ranges next to it. The block is freed once it has no buffers
+static void release_buffer(const MemoryPool::Buffer& pooled,
+                           VkInfo* vk_info) {
+    vkDestroyBuffer(vk_info->device, pooled.buffer, NULL);
+    auto& blocks = vk_info->memory_pool.blocks[pooled.memory_type];
+    auto block = std::find_if(blocks.begin(), blocks.end(), [&](auto& b) {
+        return b.memory == pooled.memory;
+    });
+    assert(block != blocks.end());
+    if (--block->buffers == 0) {
+        vkFreeMemory(vk_info->device, block->memory, NULL);
+        blocks.erase(block);
+        return;
+    }
+    block->free_ranges.give(pooled.range_offset, pooled.range_size);
+}
+
+// Take a buffer of the size class from the pool or create one.
+// Returns the mapping of its memory for host-visible buffers
+void* create_buffer(VkDeviceSize size, VkBufferUsageFlags usage,
+                    VkMemoryPropertyFlags properties, VkBuffer& buffer,
+                    VkDeviceMemory& bufferMemory, VkInfo* vk_info) {
+    MemoryPool& pool = vk_info->memory_pool;
+    std::lock_guard lock{pool.mutex};
+    VkDeviceSize buffer_size = size_class(size);
+    auto& free_buffers = pool.free_buffers[{usage, properties, buffer_size}];
+    if (!free_buffers.empty()) {
+        MemoryPool::Buffer pooled = free_buffers.back();
+        free_buffers.pop_back();
+        pool.free_buffer_bytes -= pooled.range_size;
+        pool.used_buffers[pooled.buffer] = pooled;
+        buffer = pooled.buffer;
+        bufferMemory = pooled.memory;
+        return pooled.mapped;
+    }
+
     VkBufferCreateInfo bufferInfo{};
     bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    bufferInfo.size = size;
+    bufferInfo.size = buffer_size;
     bufferInfo.usage = usage;
-    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    // Buffers are shared by the compute and the transfer queues
+    // without ownership transfers
+    uint32_t queue_family_indices[] = {vk_info->queue_family_index,
+                                       vk_info->transfer_queue_family_index};
+    if (queue_family_indices[0] != queue_family_indices[1]) {
+        bufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        bufferInfo.queueFamilyIndexCount = 2;
+        bufferInfo.pQueueFamilyIndices = queue_family_indices;
+    } else {
+        bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    }
 
     if (vkCreateBuffer(vk_info->device, &bufferInfo, nullptr, &buffer) !=
         VK_SUCCESS) {
@@ -354,158 +988,492 @@ void create_buffer(VkDeviceSize size, VkBufferUsageFlags usage,
 
     VkMemoryRequirements memRequirements;
     vkGetBufferMemoryRequirements(vk_info->device, buffer, &memRequirements);
-
-    VkMemoryAllocateInfo allocInfo{};
-    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocInfo.allocationSize = memRequirements.size;
-    allocInfo.memoryTypeIndex =
+    uint32_t memory_type =
         find_memory_type(memRequirements.memoryTypeBits, properties, vk_info);
+    MemoryPool::Buffer pooled =
+        bind_buffer_memory(buffer, memRequirements, memory_type, vk_info);
+    pooled.usage = usage;
+    pooled.properties = properties;
+    pooled.size_class = buffer_size;
+    bufferMemory = pooled.memory;
+    pool.used_buffers[buffer] = pooled;
+    return pooled.mapped;
+}
 
-    if (vkAllocateMemory(vk_info->device, &allocInfo, nullptr, &bufferMemory) !=
-        VK_SUCCESS) {
-        throw std::runtime_error("failed to allocate buffer memory!");
+// Return the buffer to the pool, the buffers kept the longest go back
+// to their blocks while the kept ones take too much memory
+void destroy_buffer(VkBuffer buffer, VkInfo* vk_info) {
+    MemoryPool& pool = vk_info->memory_pool;
+    std::lock_guard lock{pool.mutex};
+    auto it = pool.used_buffers.find(buffer);
+    assert(it != pool.used_buffers.end());
+    MemoryPool::Buffer pooled = it->second;
+    pool.used_buffers.erase(it);
+    pooled.released = pool.releases++;
+    pool.free_buffers[{pooled.usage, pooled.properties, pooled.size_class}]
+        .push_back(pooled);
+    pool.free_buffer_bytes += pooled.range_size;
+    while (pool.free_buffer_bytes > MAX_FREE_BUFFER_BYTES) {
+        std::vector<MemoryPool::Buffer>* oldest = nullptr;
+        for (auto& [key, buffers] : pool.free_buffers) {
+            if (!buffers.empty() &&
+                (oldest == nullptr ||
+                 buffers.front().released < oldest->front().released)) {
+                oldest = &buffers;
+            }
+        }
+        MemoryPool::Buffer evicted = oldest->front();
+        oldest->erase(oldest->begin());
+        pool.free_buffer_bytes -= evicted.range_size;
+        release_buffer(evicted, vk_info);
     }
+}
 
-    vkBindBufferMemory(vk_info->device, buffer, bufferMemory, 0);
+void destroy_memory_pool(VkInfo* vk_info) {
+    MemoryPool& pool = vk_info->memory_pool;
+    std::lock_guard lock{pool.mutex};
+    for (auto& [key, buffers] : pool.free_buffers) {
+        for (const MemoryPool::Buffer& pooled : buffers) {
+            vkDestroyBuffer(vk_info->device, pooled.buffer, NULL);
+        }
+    }
+    for (const auto& [buffer, pooled] : pool.used_buffers) {
+        vkDestroyBuffer(vk_info->device, buffer, NULL);
+    }
+    for (auto& blocks : pool.blocks) {
+        for (const MemoryPool::Block& block : blocks) {
+            vkFreeMemory(vk_info->device, block.memory, NULL);
+        }
+        blocks.clear();
+    }
+    pool.free_buffers.clear();
+    pool.free_buffer_bytes = 0;
+    pool.used_buffers.clear();
 }
 
-void begin_command_buffer(VkInfo* vk_info) {
+void begin_command_buffer(SortInfo* sort_info) {
     VkCommandBufferBeginInfo command_buffer_begin_info = {
         .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
         .pNext = NULL,
         .flags = 0,
         .pInheritanceInfo = NULL,
     };
-    vkBeginCommandBuffer(vk_info->command_buffer, &command_buffer_begin_info);
+    vkBeginCommandBuffer(sort_info->command_buffer, &command_buffer_begin_info);
 }
 
-void end_command_buffer(VkInfo* vk_info) {
-    vkEndCommandBuffer(vk_info->command_buffer);
+void end_command_buffer(SortInfo* sort_info) {
+    vkEndCommandBuffer(sort_info->command_buffer);
 }
 
-void bind_constants(const std::vector<push_cst_t>& push_csts, VkInfo* vk_info) {
-    vkCmdPushConstants(vk_info->command_buffer, vk_info->pipeline_layout,
+void bind_constants(const std::vector<push_cst_t>& push_csts,
+                    SortInfo* sort_info) {
+    vkCmdPushConstants(sort_info->command_buffer, sort_info->pipeline_layout,
                        VK_SHADER_STAGE_COMPUTE_BIT, 0,
                        push_csts.size() * sizeof(push_cst_t), push_csts.data());
 }
 
-void dispatch(uint32_t n, uint32_t tile_size, VkInfo* vk_info) {
-    n = (n + tile_size - 1) - (n - 1) % tile_size;
-    assert(n % tile_size == 0);
-    vkCmdBindPipeline(vk_info->command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
-                      vk_info->pipeline);
+// Workgroups that don't fit in a single row of the grid are laid out
+// in full rows of GRID_WIDTH, the last partial row is launched by
+// a dispatch of its own with the base at its row. The kernels get
+// their indices from the rows, see workgroup_index
+void dispatch(uint32_t n, uint32_t tile_size, KernelType kernel,
+              SortInfo* sort_info) {
+    uint32_t groups = (n + tile_size - 1) / tile_size;
+    vkCmdBindPipeline(sort_info->command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                      sort_info->pipelines[kernel]);
     vkCmdBindDescriptorSets(
-        vk_info->command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
-        vk_info->pipeline_layout, 0, 1, &vk_info->descriptor_set, 0, 0);
-    vkCmdDispatch(vk_info->command_buffer, n / tile_size, 1, 1);
+        sort_info->command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+        sort_info->pipeline_layout, 0, 1, &sort_info->descriptor_set, 0, 0);
+    const VkPhysicalDeviceLimits& limits =
+        sort_info->vk_info->properties.limits;
+    if (groups <= limits.maxComputeWorkGroupCount[0]) {
+        vkCmdDispatch(sort_info->command_buffer, groups, 1, 1);
+        return;
+    }
+    uint32_t rows = groups / GRID_WIDTH;
+    // The partial row takes one more
+    if (rows + (groups % GRID_WIDTH != 0) >
+        limits.maxComputeWorkGroupCount[1]) {
+        throw std::runtime_error("too many workgroups for the device");
+    }
+    vkCmdDispatch(sort_info->command_buffer, GRID_WIDTH, rows, 1);
+    if (groups % GRID_WIDTH != 0) {
+        vkCmdDispatchBase(sort_info->command_buffer, 0, rows, 0,
+                          groups % GRID_WIDTH, 1, 1);
+    }
+}
+
+void submit(SortInfo* sort_info) {
+    submit(sort_info->queue, VK_NULL_HANDLE, {}, sort_info->fence, sort_info);
 }
 
-void submit(VkInfo* vk_info) {
+// Submit the current command buffer to the queue once the wait semaphore
+// is signaled if there is one. The signal semaphores and the fence
+// if there is one are signaled once the whole command buffer is executed
+void submit(VkQueue queue, VkSemaphore wait_semaphore,
+            const std::vector<VkSemaphore>& signal_semaphores, VkFence fence,
+            SortInfo* sort_info) {
+    VkInfo* vk_info = sort_info->vk_info;
+    VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
     VkSubmitInfo submit_info = {
         .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
         .pNext = NULL,
-        .waitSemaphoreCount = 0,
-        .pWaitSemaphores = NULL,
-        .pWaitDstStageMask = NULL,
+        .waitSemaphoreCount = wait_semaphore == VK_NULL_HANDLE ? 0u : 1u,
+        .pWaitSemaphores = &wait_semaphore,
+        .pWaitDstStageMask = &wait_stage,
         .commandBufferCount = 1,
-        .pCommandBuffers = &vk_info->command_buffer,
-        .signalSemaphoreCount = 0,
-        .pSignalSemaphores = NULL,
+        .pCommandBuffers = &sort_info->command_buffer,
+        .signalSemaphoreCount = uint32_t(signal_semaphores.size()),
+        .pSignalSemaphores = signal_semaphores.data(),
+    };
+
+    if (fence != VK_NULL_HANDLE) {
+        VK_CHECK_RESULT(vkResetFences(vk_info->device, 1, &fence));
+    }
+    VK_CHECK_RESULT(vkQueueSubmit(queue, 1, &submit_info, fence));
+}
+
+void create_fence(SortInfo* sort_info) {
+    VkFenceCreateInfo fence_create_info = {
+        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+        .pNext = NULL,
+        .flags = 0,
     };
+    VK_CHECK_RESULT(vkCreateFence(sort_info->vk_info->device,
+                                  &fence_create_info, NULL,
+                                  &sort_info->fence));
+}
+
+void destroy_fence(SortInfo* sort_info) {
+    vkDestroyFence(sort_info->vk_info->device, sort_info->fence, NULL);
+}
 
+void wait_fence(VkFence fence, VkInfo* vk_info) {
     VK_CHECK_RESULT(
-        vkQueueSubmit(vk_info->queue, 1, &submit_info, VK_NULL_HANDLE));
-    VK_CHECK_RESULT(vkQueueWaitIdle(vk_info->queue));
+        vkWaitForFences(vk_info->device, 1, &fence, VK_TRUE, UINT64_MAX));
 }
 
-void destroy(VkInfo* vk_info) {
-    vkFreeCommandBuffers(vk_info->device, vk_info->command_pool, 1,
-                         &vk_info->command_buffer);
-    vkDestroyCommandPool(vk_info->device, vk_info->command_pool, NULL);
-    vkDestroyDescriptorPool(vk_info->device, vk_info->descriptor_pool, NULL);
-    vkDestroyPipeline(vk_info->device, vk_info->pipeline, NULL);
-    vkDestroyPipelineLayout(vk_info->device, vk_info->pipeline_layout, NULL);
-    vkDestroyDescriptorSetLayout(vk_info->device,
-                                 vk_info->descriptor_set_layout, NULL);
-    vkDestroyShaderModule(vk_info->device, vk_info->shader_module, NULL);
-    destroy_array_storage(vk_info->arr, vk_info);
+bool fence_signaled(VkFence fence, VkInfo* vk_info) {
+    return vkGetFenceStatus(vk_info->device, fence) == VK_SUCCESS;
+}
+
+VkSemaphore create_semaphore(VkInfo* vk_info) {
+    VkSemaphoreCreateInfo semaphore_create_info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        .pNext = NULL,
+        .flags = 0,
+    };
+    VkSemaphore semaphore;
+    VK_CHECK_RESULT(vkCreateSemaphore(vk_info->device, &semaphore_create_info,
+                                      NULL, &semaphore));
+    return semaphore;
+}
+
+void destroy_semaphore(VkSemaphore semaphore, VkInfo* vk_info) {
+    vkDestroySemaphore(vk_info->device, semaphore, NULL);
+}
+
+// Destroy the device, but not the instance it may share with others
+void destroy_device(VkInfo* vk_info) {
+    save_pipeline_cache(vk_info);
+    destroy_memory_pool(vk_info);
+    vkDestroyPipelineCache(vk_info->device, vk_info->pipeline_cache, NULL);
     vkDestroyDevice(vk_info->device, NULL);
+}
+
+void destroy(VkInfo* vk_info) {
+    destroy_device(vk_info);
     vkDestroyInstance(vk_info->instance, NULL);
 }
 
-void load_input(VkInfo* vk_info) {
+// The pools free the command buffers and descriptor sets allocated from
+// them, the arrays are freed by their owner
+void destroy_sort_info(SortInfo* sort_info) {
+    VkInfo* vk_info = sort_info->vk_info;
+    vkDestroyCommandPool(vk_info->device, sort_info->command_pool, NULL);
+    vkDestroyCommandPool(vk_info->device, sort_info->transfer_command_pool,
+                         NULL);
+    vkDestroyDescriptorPool(vk_info->device, sort_info->descriptor_pool, NULL);
+    for (size_t kernel = 0; kernel < NUM_KERNELS; kernel++) {
+        vkDestroyPipeline(vk_info->device, sort_info->pipelines[kernel], NULL);
+    }
+    vkDestroyPipelineLayout(vk_info->device, sort_info->pipeline_layout, NULL);
+    vkDestroyDescriptorSetLayout(vk_info->device,
+                                 sort_info->descriptor_set_layout, NULL);
+    for (size_t kernel = 0; kernel < NUM_KERNELS; kernel++) {
+        vkDestroyShaderModule(vk_info->device,
+                              sort_info->shader_modules[kernel], NULL);
+    }
+}
+
+void load_input(SortInfo* sort_info) {
+    load_input(0, sort_info->arr.get_elements_num(), sort_info);
+}
+
+// Transfer the elements [first, first + count) of the array to GPU,
+// unified storage is there already
+void load_input(uint32_t first, uint32_t count, SortInfo* sort_info) {
+    if (sort_info->arr.is_unified()) {
+        return;
+    }
+    VkDeviceSize element_size = sort_info->arr.get_element_size();
+    VkBufferCopy buffer_copy = {
+        .srcOffset = first * element_size,
+        .dstOffset = first * element_size,
+        .size = count * element_size,
+    };
+    vkCmdCopyBuffer(sort_info->command_buffer, sort_info->arr.get_host_buffer(),
+                    sort_info->arr.get_device_buffer(), 1, &buffer_copy);
+    if (sort_info->arr.has_values()) {
+        VkDeviceSize value_size = sort_info->arr.get_value_size();
+        VkBufferCopy values_copy = {
+            .srcOffset = first * value_size,
+            .dstOffset = first * value_size,
+            .size = count * value_size,
+        };
+        vkCmdCopyBuffer(sort_info->command_buffer,
+                        sort_info->arr.get_values_host_buffer(),
+                        sort_info->arr.get_values_device_buffer(), 1,
+                        &values_copy);
+    }
+}
+
+void load_output(SortInfo* sort_info) {
+    load_output(0, sort_info->arr.get_elements_num(), sort_info);
+}
+
+// Transfer the elements [first, first + count) of the array back from GPU
+void load_output(uint32_t first, uint32_t count, SortInfo* sort_info) {
+    if (sort_info->arr.is_unified()) {
+        return;
+    }
+    VkDeviceSize element_size = sort_info->arr.get_element_size();
     VkBufferCopy buffer_copy = {
-        .srcOffset = 0,
-        .dstOffset = 0,
-        .size = vk_info->arr.get_buffer_size(),
+        .srcOffset = first * element_size,
+        .dstOffset = first * element_size,
+        .size = count * element_size,
     };
-    vkCmdCopyBuffer(vk_info->command_buffer, vk_info->arr.get_host_buffer(),
-                    vk_info->arr.get_device_buffer(), 1, &buffer_copy);
+    vkCmdCopyBuffer(sort_info->command_buffer,
+                    sort_info->arr.get_device_buffer(),
+                    sort_info->arr.get_host_buffer(), 1, &buffer_copy);
+    if (sort_info->arr.has_values()) {
+        VkDeviceSize value_size = sort_info->arr.get_value_size();
+        VkBufferCopy values_copy = {
+            .srcOffset = first * value_size,
+            .dstOffset = first * value_size,
+            .size = count * value_size,
+        };
+        vkCmdCopyBuffer(sort_info->command_buffer,
+                        sort_info->arr.get_values_device_buffer(),
+                        sort_info->arr.get_values_host_buffer(), 1,
+                        &values_copy);
+    }
+}
+
+// Fill the padding of the device buffer with a repeated 32-bit word
+void fill_padding(uint32_t pattern, SortInfo* sort_info) {
+    VkDeviceSize offset = sort_info->arr.get_buffer_size();
+    VkDeviceSize size = sort_info->arr.get_padded_buffer_size() - offset;
+    if (size == 0) {
+        return;
+    }
+    vkCmdFillBuffer(sort_info->command_buffer,
+                    sort_info->arr.get_device_buffer(), offset, size, pattern);
 }
 
-void load_output(VkInfo* vk_info) {
+// Transfer the padding prepared in the host buffer to GPU
+void load_padding(SortInfo* sort_info) {
+    if (sort_info->arr.is_unified()) {
+        return;
+    }
+    VkDeviceSize offset = sort_info->arr.get_buffer_size();
+    VkDeviceSize size = sort_info->arr.get_padded_buffer_size() - offset;
+    if (size == 0) {
+        return;
+    }
     VkBufferCopy buffer_copy = {
-        .srcOffset = 0,
-        .dstOffset = 0,
-        .size = vk_info->arr.get_buffer_size(),
+        .srcOffset = offset,
+        .dstOffset = offset,
+        .size = size,
     };
-    vkCmdCopyBuffer(vk_info->command_buffer, vk_info->arr.get_device_buffer(),
-                    vk_info->arr.get_host_buffer(), 1, &buffer_copy);
+    vkCmdCopyBuffer(sort_info->command_buffer, sort_info->arr.get_host_buffer(),
+                    sort_info->arr.get_device_buffer(), 1, &buffer_copy);
 }
 
+// Host reads are the ones after the fence of the submission
 void put_write_read_barrier(MemoryAccessType m_src, MemoryAccessType m_dst,
-                            VkInfo* vk_info) {
+                            SortInfo* sort_info) {
     VkMemoryBarrier mb = {
         .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
         .pNext = NULL,
         .srcAccessMask = m_src == Transfer ? VK_ACCESS_TRANSFER_WRITE_BIT
                                            : VK_ACCESS_SHADER_WRITE_BIT,
         .dstAccessMask = m_dst == Transfer ? VK_ACCESS_TRANSFER_READ_BIT
+                         : m_dst == Host   ? VK_ACCESS_HOST_READ_BIT
                                            : VK_ACCESS_SHADER_READ_BIT,
     };
-    vkCmdPipelineBarrier(
-        vk_info->command_buffer,
-        m_src == Transfer ? VK_PIPELINE_STAGE_TRANSFER_BIT
-                          : VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+    VkPipelineStageFlags src_stage = m_src == Transfer
+                                         ? VK_PIPELINE_STAGE_TRANSFER_BIT
+                                         : VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    VkPipelineStageFlags dst_stage =
         m_dst == Transfer ? VK_PIPELINE_STAGE_TRANSFER_BIT
-                          : VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-        0, 1, &mb, 0, 0, 0, 0);
+        : m_dst == Host   ? VK_PIPELINE_STAGE_HOST_BIT
+                          : VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    vkCmdPipelineBarrier(sort_info->command_buffer, src_stage, dst_stage, 0, 1,
+                         &mb, 0, 0, 0, 0);
 }
 
-Array<CTYPE> create_array_storage(uint32_t n, VkInfo* vk_info) {
-    Array<CTYPE> arr{n};
-
-    create_buffer(arr.get_buffer_size(),
-                  VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
-                      VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                  arr.get_host_buffer(), arr.get_host_memory(), vk_info);
+// A power of 2 covering at least a block of the local kernel,
+// so that every workgroup and every merge group is full
+uint32_t padded_size(uint32_t n, SortInfo* sort_info) {
+    uint32_t padded_n = sort_info->spec_constants.tile_size *
+                        sort_info->spec_constants.register_run;
+    while (padded_n < n) {
+        padded_n *= 2;
+    }
+    return padded_n;
+}
 
-    create_buffer(arr.get_buffer_size(),
-                  VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
-                      VK_BUFFER_USAGE_TRANSFER_DST_BIT |
-                      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, arr.get_device_buffer(),
-                  arr.get_device_memory(), vk_info);
+ArrayStorage create_array_storage(uint32_t n, size_t element_size,
+                                  size_t value_size, uint32_t padded_n,
+                                  VkInfo* vk_info) {
+    ArrayStorage arr{n, element_size, value_size, padded_n,
+                     vk_info->unified_memory};
+    VkBufferUsageFlags device_usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                                      VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                                      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+
+    if (arr.is_unified()) {
+        arr.get_mapped() = create_buffer(
+            arr.get_padded_buffer_size(), device_usage,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            arr.get_device_buffer(), arr.get_device_memory(), vk_info);
+        arr.get_host_buffer() = arr.get_device_buffer();
+        arr.get_host_memory() = arr.get_device_memory();
+    } else {
+        arr.get_mapped() = create_buffer(
+            arr.get_padded_buffer_size(),
+            VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            arr.get_host_buffer(), arr.get_host_memory(), vk_info);
+
+        create_buffer(arr.get_padded_buffer_size(), device_usage,
+                      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                      arr.get_device_buffer(), arr.get_device_memory(),
+                      vk_info);
+    }
 
-    vkMapMemory(vk_info->device, arr.get_host_memory(), 0,
-                arr.get_buffer_size(), 0, (void**)&arr.get_buffer());
+    if (arr.has_values()) {
+        if (arr.is_unified()) {
+            arr.get_values_mapped() = create_buffer(
+                arr.get_values_buffer_size(), device_usage,
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+                    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                    VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                arr.get_values_device_buffer(),
+                arr.get_values_device_memory(), vk_info);
+            arr.get_values_host_buffer() = arr.get_values_device_buffer();
+            arr.get_values_host_memory() = arr.get_values_device_memory();
+        } else {
+            arr.get_values_mapped() =
+                create_buffer(arr.get_values_buffer_size(),
+                              VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                                  VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                              VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                  VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                              arr.get_values_host_buffer(),
+                              arr.get_values_host_memory(), vk_info);
+
+            create_buffer(arr.get_values_buffer_size(), device_usage,
+                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                          arr.get_values_device_buffer(),
+                          arr.get_values_device_memory(), vk_info);
+        }
+    }
 
     return arr;
 }
 
-void destroy_array_storage(const Array<CTYPE>& arr, VkInfo* vk_info) {
-    vkUnmapMemory(vk_info->device, arr.get_host_memory());
-    vkDestroyBuffer(vk_info->device, arr.get_host_buffer(), NULL);
-    vkFreeMemory(vk_info->device, arr.get_host_memory(), NULL);
-    vkDestroyBuffer(vk_info->device, arr.get_device_buffer(), NULL);
-    vkFreeMemory(vk_info->device, arr.get_device_memory(), NULL);
+// The buffers go back to the pool of the device
+void destroy_array_storage(const ArrayStorage& arr, VkInfo* vk_info) {
+    if (!arr.is_unified()) {
+        destroy_buffer(arr.get_host_buffer(), vk_info);
+    }
+    destroy_buffer(arr.get_device_buffer(), vk_info);
+    if (arr.has_values()) {
+        if (!arr.is_unified()) {
+            destroy_buffer(arr.get_values_host_buffer(), vk_info);
+        }
+        destroy_buffer(arr.get_values_device_buffer(), vk_info);
+    }
 }
 
 VkInfoGuard::VkInfoGuard() {
     set_instance(&info);
-    set_physical_device(&info);
+    set_physical_device(&info, select_device(&info));
 }
 VkInfo* VkInfoGuard::get() { return &info; }
 VkInfoGuard::~VkInfoGuard() { destroy(&info); }
+
+// The first device owns the instance. A single device is the given one,
+// or the best one if the index is negative
+VkDevicesGuard::VkDevicesGuard(bool all_devices, int device_index) {
+    infos.push_back(std::make_unique<VkInfo>());
+    VkInfo* first = infos[0].get();
+    set_instance(first);
+    std::vector<uint32_t> indices;
+    try {
+        if (all_devices) {
+            uint32_t device_count = count_physical_devices(first);
+            for (uint32_t i = 0; i < device_count; i++) {
+                if (is_suitable_device(i, first)) {
+                    indices.push_back(i);
+                }
+            }
+        } else if (device_index < 0) {
+            indices.push_back(select_device(first));
+        } else if (uint32_t(device_index) < count_physical_devices(first) &&
+                   is_suitable_device(device_index, first)) {
+            indices.push_back(device_index);
+        }
+        if (indices.empty()) {
+            throw std::runtime_error("no such device supports compute queues");
+        }
+    } catch (...) {
+        vkDestroyInstance(first->instance, NULL);
+        throw;
+    }
+    for (size_t i = 1; i < indices.size(); i++) {
+        infos.push_back(std::make_unique<VkInfo>());
+        infos.back()->instance = first->instance;
+    }
+    // A device isn't created when set_physical_device throws, the ones
+    // before it are
+    for (size_t i = 0; i < indices.size(); i++) {
+        try {
+            set_physical_device(infos[i].get(), indices[i]);
+        } catch (...) {
+            while (i-- > 0) {
+                destroy_device(infos[i].get());
+            }
+            vkDestroyInstance(first->instance, NULL);
+            throw;
+        }
+    }
+}
+std::vector<VkInfo*> VkDevicesGuard::get() {
+    std::vector<VkInfo*> result;
+    for (auto& info : infos) {
+        result.push_back(info.get());
+    }
+    return result;
+}
+VkDevicesGuard::~VkDevicesGuard() {
+    for (size_t i = infos.size(); i-- > 1;) {
+        destroy_device(infos[i].get());
+    }
+    destroy(infos[0].get());
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <iostream>
+
+// Failed checks of the test so far, main returns the exit code
+inline int failures = 0;
+
+// A failed check is reported with its line, the test goes on
+#define CHECK(condition)                                                       \
+    do {                                                                       \
+        if (!(condition)) {                                                    \
+            std::cerr << __FILE__ << ":" << __LINE__                           \
+                      << ": check failed: " #condition << std::endl;           \
+            failures++;                                                        \
+        }                                                                      \
+    } while (0)
+
+inline int exit_code() { return failures == 0 ? 0 : 1; }
@@ -0,0 +1,66 @@
+#include "check.h"
+#include "cpu_sorter.h"
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <span>
+#include <vector>
+
+// Lengths around the blocks of the SIMD kernels and the tiles, powers of
+// 2 and the ones just past them
+constexpr size_t LENGTHS[] = {0,   1,    2,    3,     15,    16,    17,
+                              100, 1000, 4096, 4097,  20011, 65536};
+
+// Keys from a narrow range, so that there are many equal ones. Every
+// payload is the index of its key, the sorted payloads have to point
+// to their keys in the input
+template <typename T>
+static void check_sort(CpuSorter& sorter, size_t n, bool payloads) {
+    std::mt19937 random(n);
+    std::vector<T> keys(n);
+    for (T& key : keys) {
+        key = T(random() % 1000) - T(std::is_signed_v<T> ? 500 : 0);
+    }
+    std::vector<T> input = keys;
+    std::vector<uint32_t> values(n);
+    for (size_t i = 0; i < n; i++) {
+        values[i] = i;
+    }
+    if (payloads) {
+        sorter.sort(std::span{keys}, std::span{values});
+    } else {
+        sorter.sort(std::span{keys});
+    }
+    std::vector<T> expected = input;
+    std::sort(expected.begin(), expected.end());
+    CHECK(keys == expected);
+    for (size_t i = 0; payloads && i < n; i++) {
+        CHECK(input[values[i]] == keys[i]);
+    }
+}
+
+template <typename T> static void check_sorts(CpuSorter& sorter) {
+    for (size_t n : LENGTHS) {
+        check_sort<T>(sorter, n, false);
+        check_sort<T>(sorter, n, true);
+    }
+}
+
+// Tiles of a few blocks have many of them even in short arrays, so most
+// merge groups go through merge_tiles and merge_boundary
+int main() {
+    for (CpuSchedule schedule : {Barriers, Dataflow}) {
+        for (uint32_t threads : {1, 2, 3, 8}) {
+            for (size_t tile_bytes : {64, 256, 4096, 0}) {
+                CpuSorter sorter{threads, tile_bytes, schedule};
+                check_sorts<uint32_t>(sorter);
+                check_sorts<int32_t>(sorter);
+                check_sorts<uint64_t>(sorter);
+                check_sorts<int64_t>(sorter);
+                check_sorts<float>(sorter);
+                check_sorts<double>(sorter);
+            }
+        }
+    }
+    return exit_code();
+}
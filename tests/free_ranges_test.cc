@@ -0,0 +1,94 @@
+#include "check.h"
+#include "free_ranges.h"
+#include <map>
+#include <random>
+#include <vector>
+
+using Ranges = std::map<uint64_t, uint64_t>;
+
+static void test_first_fit() {
+    FreeRanges ranges(1024);
+    auto a = ranges.take(100, 1);
+    CHECK(a && a->start == 0 && a->offset == 0 && a->size == 100);
+    // The padding up to the alignment belongs to the taken range
+    auto b = ranges.take(100, 64);
+    CHECK(b && b->start == 100 && b->offset == 128 && b->size == 128);
+    CHECK((ranges.get() == Ranges{{228, 796}}));
+    ranges.give(a->start, a->size);
+    // The freed range at the front fits and comes first
+    auto c = ranges.take(50, 16);
+    CHECK(c && c->start == 0 && c->offset == 0 && c->size == 50);
+    CHECK((ranges.get() == Ranges{{50, 50}, {228, 796}}));
+    // It doesn't fit 60 bytes after the alignment, the next range does
+    auto d = ranges.take(60, 32);
+    CHECK(d && d->start == 228 && d->offset == 256 && d->size == 88);
+    CHECK(!ranges.take(1024, 1));
+}
+
+static void test_coalescing() {
+    FreeRanges ranges(400);
+    auto a = ranges.take(100, 1);
+    auto b = ranges.take(100, 1);
+    auto c = ranges.take(100, 1);
+    auto d = ranges.take(100, 1);
+    CHECK(a && b && c && d && ranges.get().empty());
+    ranges.give(a->start, a->size);
+    ranges.give(c->start, c->size);
+    CHECK((ranges.get() == Ranges{{0, 100}, {200, 100}}));
+    // Merged with the free ranges on both sides
+    ranges.give(b->start, b->size);
+    CHECK((ranges.get() == Ranges{{0, 300}}));
+    ranges.give(d->start, d->size);
+    CHECK((ranges.get() == Ranges{{0, 400}}));
+    CHECK(ranges.take(400, 1));
+}
+
+// Random takes and gives keep the free ranges disjoint, apart from each
+// other and from the taken ones, and the whole block is free at the end
+static void test_random() {
+    std::mt19937 random{1};
+    const uint64_t size = 1 << 16;
+    FreeRanges ranges(size);
+    std::vector<FreeRanges::Range> taken;
+    for (int round = 0; round < 10000; round++) {
+        if (taken.empty() || random() % 2 == 0) {
+            uint64_t alignment = uint64_t(1) << random() % 8;
+            auto range = ranges.take(1 + random() % 2000, alignment);
+            if (range) {
+                CHECK(range->offset % alignment == 0);
+                taken.push_back(*range);
+            }
+        } else {
+            size_t k = random() % taken.size();
+            ranges.give(taken[k].start, taken[k].size);
+            taken.erase(taken.begin() + k);
+        }
+        Ranges all = ranges.get();
+        uint64_t free_end = UINT64_MAX;
+        for (auto [start, length] : ranges.get()) {
+            CHECK(length > 0);
+            CHECK(start != free_end);
+            free_end = start + length;
+        }
+        for (const FreeRanges::Range& range : taken) {
+            CHECK(all.emplace(range.start, range.size).second);
+        }
+        uint64_t end = 0;
+        for (auto [start, length] : all) {
+            CHECK(start == end);
+            end = start + length;
+        }
+        CHECK(end == size);
+    }
+    for (const FreeRanges::Range& range : taken) {
+        ranges.give(range.start, range.size);
+    }
+    CHECK((ranges.get() == Ranges{{0, size}}));
+}
+
+int main() {
+    test_first_fit();
+    test_coalescing();
+    test_random();
+    return exit_code();
+}
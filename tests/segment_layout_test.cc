@@ -0,0 +1,101 @@
+#include "check.h"
+#include "segment_layout.h"
+#include <bit>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+static bool throws(std::vector<uint32_t> offsets, size_t n, size_t max_size) {
+    std::vector<Segment> segments;
+    try {
+        lay_out_segments(offsets, n, max_size, segments);
+    } catch (const std::runtime_error&) {
+        return true;
+    }
+    return false;
+}
+
+// Segments of 3, 0, 1, 8, 1 and 7 elements
+static void test_example() {
+    std::vector<uint32_t> offsets = {0, 3, 3, 4, 12, 13, 20};
+    std::vector<Segment> segments;
+    Layout layout = lay_out_segments(offsets, 20, 1 << 20, segments);
+    CHECK(segments.size() == 3);
+    CHECK(segments[0].offset == 4 && segments[0].length == 8 &&
+          segments[0].padded_length == 8 && segments[0].padded_offset == 0);
+    CHECK(segments[1].offset == 13 && segments[1].length == 7 &&
+          segments[1].padded_length == 8 && segments[1].padded_offset == 8);
+    CHECK(segments[2].offset == 0 && segments[2].length == 3 &&
+          segments[2].padded_length == 4 && segments[2].padded_offset == 16);
+    CHECK(layout.n == 20);
+    CHECK((layout.bounds == std::vector<uint32_t>{20, 20, 16}));
+}
+
+static void test_short_segments() {
+    std::vector<uint32_t> offsets = {0, 1, 1, 2};
+    std::vector<Segment> segments;
+    Layout layout = lay_out_segments(offsets, 2, 1 << 20, segments);
+    CHECK(segments.empty());
+    CHECK(layout.n == 0 && layout.bounds.empty());
+}
+
+static void test_errors() {
+    CHECK(throws({0, 4, 2}, 8, 1 << 20));
+    CHECK(throws({0, 9}, 8, 1 << 20));
+    CHECK(!throws({0, 8}, 8, 8));
+    // 5 elements are padded to 8
+    CHECK(throws({0, 5}, 8, 7));
+    CHECK(throws({0, 4, 8, 12}, 12, 11));
+}
+
+// Segments start at multiples of their padded lengths, one after
+// another by decreasing lengths, and the bounds hold the segments of
+// at least the size of their level
+static void test_random() {
+    std::mt19937 random{1};
+    for (int round = 0; round < 1000; round++) {
+        std::vector<uint32_t> offsets = {0};
+        size_t count = random() % 20;
+        for (size_t k = 0; k < count; k++) {
+            uint32_t length = random() % (1u << random() % 12);
+            offsets.push_back(offsets.back() + length);
+        }
+        size_t n = offsets.back() + random() % 4;
+        std::vector<Segment> segments;
+        Layout layout = lay_out_segments(offsets, n, SIZE_MAX, segments);
+        size_t expected = 0;
+        for (size_t k = 0; k + 1 < offsets.size(); k++) {
+            expected += offsets[k + 1] - offsets[k] >= 2;
+        }
+        CHECK(segments.size() == expected);
+        uint32_t end = 0;
+        for (size_t k = 0; k < segments.size(); k++) {
+            const Segment& segment = segments[k];
+            CHECK(segment.length >= 2);
+            CHECK(segment.padded_length == std::bit_ceil(segment.length));
+            CHECK(segment.padded_offset == end);
+            CHECK(segment.padded_offset % segment.padded_length == 0);
+            CHECK(k == 0 ||
+                  segments[k - 1].padded_length >= segment.padded_length);
+            end += segment.padded_length;
+        }
+        CHECK(layout.n == end);
+        for (size_t level = 0; level < layout.bounds.size(); level++) {
+            uint32_t bound = 0;
+            for (const Segment& segment : segments) {
+                if (segment.padded_length >= 2u << level) {
+                    bound += segment.padded_length;
+                }
+            }
+            CHECK(layout.bounds[level] == bound);
+        }
+    }
+}
+
+int main() {
+    test_example();
+    test_short_segments();
+    test_errors();
+    test_random();
+    return exit_code();
+}
@@ -0,0 +1,76 @@
+#include "check.h"
+#include "key_type.h"
+#include "simd_sort.h"
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+// Keys from a narrow range with the maximal key among them, which pads
+// the short blocks
+template <typename T> static std::vector<T> random_keys(size_t n, int seed) {
+    std::mt19937 random(seed);
+    std::vector<T> keys(n);
+    for (T& key : keys) {
+        key = random() % 16 == 0 ? sentinel<T>() : T(random() % 100);
+    }
+    return keys;
+}
+
+template <typename T> static void check_kernels(const SimdKernels<T>& kernels) {
+    CHECK(kernels.block >= 1 && kernels.block <= MAX_SIMD_BLOCK);
+    CHECK((kernels.block & (kernels.block - 1)) == 0);
+    for (size_t count = 0; count <= kernels.block; count++) {
+        std::vector<T> keys = random_keys<T>(count, count);
+        std::vector<T> expected = keys;
+        std::sort(expected.begin(), expected.end());
+        kernels.sort_block(keys.data(), count);
+        CHECK(keys == expected);
+    }
+    for (int round = 0; round < 200; round++) {
+        std::vector<T> a = random_keys<T>(round * 7 % 150, round);
+        std::vector<T> b = random_keys<T>(round * 13 % 170, round + 1000);
+        std::sort(a.begin(), a.end());
+        std::sort(b.begin(), b.end());
+        std::vector<T> out(a.size() + b.size());
+        kernels.merge(a.data(), a.size(), b.data(), b.size(), out.data());
+        std::vector<T> expected(out.size());
+        std::merge(a.begin(), a.end(), b.begin(), b.end(), expected.begin());
+        CHECK(out == expected);
+    }
+    for (size_t count = 0; count < 100; count++) {
+        std::vector<T> lo = random_keys<T>(count, count);
+        std::vector<T> hi = random_keys<T>(count, count + 1000);
+        std::vector<T> expected_lo(count);
+        std::vector<T> expected_hi(count);
+        for (size_t k = 0; k < count; k++) {
+            expected_lo[k] = std::min(lo[k], hi[k]);
+            expected_hi[k] = std::max(lo[k], hi[k]);
+        }
+        kernels.compare(lo.data(), hi.data(), count);
+        CHECK(lo == expected_lo && hi == expected_hi);
+    }
+}
+
+// The kernels of every instruction set the CPU supports
+template <typename T> static void check_levels() {
+    check_kernels(scalar_kernels<T>());
+#ifdef HAVE_X86_SIMD
+    if (simd_level() >= Avx2) {
+        check_kernels(avx2_kernels<T>());
+    }
+    if (simd_level() >= Avx512) {
+        check_kernels(avx512_kernels<T>());
+    }
+#endif
+}
+
+int main() {
+    check_levels<uint32_t>();
+    check_levels<int32_t>();
+    check_levels<uint64_t>();
+    check_levels<int64_t>();
+    check_levels<float>();
+    check_levels<double>();
+    return exit_code();
+}
@@ -0,0 +1,59 @@
+#include "check.h"
+#include "task_graph.h"
+#include "thread_pool.h"
+#include <atomic>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+// Random graphs of tasks each waiting for a few earlier ones, some
+// without any. Every task runs once and after all the ones it waits for
+static void check_graph(ThreadPool& pool, uint32_t tasks, int seed) {
+    std::mt19937 random(seed);
+    TaskGraph graph;
+    std::vector<std::vector<uint32_t>> deps(tasks);
+    for (uint32_t t = 0; t < tasks; t++) {
+        size_t count = t == 0 ? 0 : random() % 4;
+        for (size_t k = 0; k < count; k++) {
+            deps[t].push_back(random() % t);
+        }
+        CHECK(graph.add(deps[t]) == t);
+    }
+    CHECK(graph.size() == tasks);
+
+    std::atomic<uint32_t> finished{0};
+    std::vector<std::atomic<uint32_t>> runs(tasks);
+    std::vector<uint32_t> order(tasks);
+    std::atomic<bool> early{false};
+    graph.run(pool, [&](uint32_t t) {
+        for (uint32_t dep : deps[t]) {
+            if (runs[dep].load(std::memory_order_acquire) == 0) {
+                early.store(true);
+            }
+        }
+        order[t] = finished.fetch_add(1);
+        runs[t].fetch_add(1, std::memory_order_release);
+    });
+    CHECK(!early.load());
+    CHECK(finished.load() == tasks);
+    for (uint32_t t = 0; t < tasks; t++) {
+        CHECK(runs[t].load() == 1);
+        for (uint32_t dep : deps[t]) {
+            CHECK(order[dep] < order[t]);
+        }
+    }
+}
+
+int main() {
+    for (uint32_t threads : {1, 2, 4, 8}) {
+        ThreadPool pool{threads};
+        CHECK(pool.size() == threads);
+        // An empty graph returns at once, a long one grows the deques
+        check_graph(pool, 0, 0);
+        for (int seed = 1; seed <= 20; seed++) {
+            check_graph(pool, 1 + seed * 97, seed);
+        }
+        check_graph(pool, 100000, 0);
+    }
+    return exit_code();
+}